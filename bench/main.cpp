@@ -0,0 +1,476 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Each lexer lives in a header of its own namespace, so one binary can run both on the
+// same input.
+#include "../lexer.h"
+#include "../state/automaton.h"
+
+
+// Every allocation in the process goes through here so a run can report allocations per token.
+// GCC pairs the inlined free() in operator delete with operator new rather than with the
+// malloc() inside it and warns; the pairing is right.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+static std::atomic<uint64_t> allocationCount{0};
+
+void* operator new(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+
+// Deterministic generator for synthetic corpora shaped like ruby_code.txt: classes of short
+// methods whose lines are drawn from weighted statement kinds.
+class CorpusGenerator {
+public:
+    enum Kind { IDENTIFIERS, COMMENTS, STRINGS, NUMBERS, UNICODE, KIND_COUNT };
+
+    struct Profile {
+        const char* name;
+        std::array<int, KIND_COUNT> weights;
+    };
+
+    static constexpr Profile profiles[] = {
+        {"mixed",       {40, 15, 15, 20, 10}},
+        {"identifiers", {85,  5,  5,  5,  0}},
+        {"comments",    {10, 80,  5,  5,  0}},
+        {"strings",     {10,  5, 80,  5,  0}},
+        {"numbers",     {10,  5,  5, 80,  0}},
+        {"unicode",     {20,  5,  5,  5, 65}},
+    };
+
+    static const Profile* findProfile(std::string_view name) {
+        for (const auto& profile : profiles) {
+            if (name == profile.name) return &profile;
+        }
+        return nullptr;
+    }
+
+    explicit CorpusGenerator(uint64_t seed = 42) : state(seed) {}
+
+    std::string generate(const Profile& profile, size_t bytes) {
+        std::string out;
+        out.reserve(bytes + 256);
+        int total = std::accumulate(profile.weights.begin(), profile.weights.end(), 0);
+        while (out.size() < bytes) {
+            out += "class ";
+            out += constant();
+            out += "\n";
+            for (int method = 0, methods = 2 + random(4); method < methods && out.size() < bytes; method++) {
+                out += "  def ";
+                out += identifier();
+                out += "(";
+                out += identifier();
+                out += ")\n";
+                for (int line = 0, lines = 3 + random(8); line < lines; line++) {
+                    out += "    ";
+                    statement(pick(profile.weights, total), out);
+                    out += "\n";
+                }
+                out += "  end\n\n";
+            }
+            out += "end\n\n";
+        }
+        return out;
+    }
+
+private:
+    uint64_t state;
+
+    uint32_t random(uint32_t bound) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        return static_cast<uint32_t>(state >> 33) % bound;
+    }
+
+    Kind pick(const std::array<int, KIND_COUNT>& weights, int total) {
+        int r = random(total);
+        for (int k = 0; k < KIND_COUNT; k++) {
+            if (r < weights[k]) return static_cast<Kind>(k);
+            r -= weights[k];
+        }
+        return IDENTIFIERS;
+    }
+
+    template <size_t N>
+    const char* choose(const char* const (&words)[N]) { return words[random(N)]; }
+
+    std::string identifier() {
+        static const char* const words[] = {"name", "count", "user", "total", "index", "value", "item",
+                                            "last_user", "result", "buffer", "legacy_id", "normal_id"};
+        std::string word = choose(words);
+        if (random(3) == 0) {
+            word += "_";
+            word += choose(words);
+        }
+        return word;
+    }
+
+    std::string constant() {
+        static const char* const words[] = {"User", "Account", "Parser", "Session", "Report", "Config"};
+        return std::string(choose(words)) + choose(words);
+    }
+
+    std::string number() {
+        switch (random(4)) {
+            case 0: return std::to_string(random(100000));
+            case 1: return std::to_string(random(1000)) + "." + std::to_string(random(100));
+            case 2: {
+                char hex[16];
+                std::snprintf(hex, sizeof(hex), "0x%x", random(1 << 24));
+                return hex;
+            }
+            default: return "00" + std::to_string(random(8));
+        }
+    }
+
+    void statement(Kind kind, std::string& out) {
+        static const char* const prefixes[] = {"", "@", "@@", "$"};
+        static const char* const operators[] = {" = ", " += ", " == ", " || ", " * ", " <= "};
+        static const char* const sentences[] = {"simple string", "Output: 1", "TODO handle the empty case",
+                                                "Welcome, #{@name}!", "value with an \\\"escaped\\\" quote"};
+        static const char* const ukrainian[] = {"Приклад з різними типами чисел", "Це однорядковий коментар",
+                                                "Привіт, світе", "Кількість користувачів"};
+        switch (kind) {
+            case IDENTIFIERS:
+                out += choose(prefixes);
+                out += identifier();
+                out += choose(operators);
+                out += identifier();
+                out += ".";
+                out += identifier();
+                out += "(:";
+                out += identifier();
+                out += ", ";
+                out += constant();
+                out += ")";
+                break;
+            case COMMENTS:
+                out += "# ";
+                out += choose(sentences);
+                out += " ";
+                out += identifier();
+                break;
+            case STRINGS: {
+                char quote = random(2) ? '"' : '\'';
+                out += "puts ";
+                out += quote;
+                out += quote == '"' ? choose(sentences) : identifier();
+                out += quote;
+                break;
+            }
+            case NUMBERS:
+                out += "@";
+                out += identifier();
+                out += " = ";
+                out += number();
+                out += " + ";
+                out += number();
+                out += " if (1..";
+                out += number();
+                out += ")";
+                break;
+            case UNICODE:
+                if (random(2)) {
+                    out += "# ";
+                    out += choose(ukrainian);
+                } else {
+                    out += "label = \"";
+                    out += choose(ukrainian);
+                    out += "\"";
+                }
+                break;
+            case KIND_COUNT:
+                break;
+        }
+    }
+};
+
+
+struct BenchResult {
+    double seconds = 0;        // best of the repetitions
+    size_t tokens = 0;
+    uint64_t allocations = 0;  // in one run
+    long peakRssKb = 0;
+    uint64_t cycles = 0;       // timestamp-counter ticks of the best run; 0 where unavailable
+};
+
+inline uint64_t readCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Resets the kernel's high-water mark for resident memory so each run reports its own peak.
+// Leaves it alone (and the peak cumulative) on kernels without clear_refs.
+void resetPeakRss() {
+    int fd = ::open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0) return;
+    ssize_t written = ::write(fd, "5", 1);
+    (void)written;
+    ::close(fd);
+}
+
+long peakRssKb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) return std::atol(line.c_str() + 6);
+    }
+    return 0;
+}
+
+template <typename Run>
+BenchResult measure(int repetitions, Run run) {
+    BenchResult result;
+    result.seconds = 1e300;
+    resetPeakRss();
+    for (int rep = 0; rep < repetitions; rep++) {
+        uint64_t allocationsBefore = allocationCount.load(std::memory_order_relaxed);
+        uint64_t cyclesBefore = readCycleCounter();
+        auto startTime = std::chrono::steady_clock::now();
+        size_t tokens = run();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        uint64_t cycles = readCycleCounter() - cyclesBefore;
+        if (seconds < result.seconds) {
+            result.seconds = seconds;
+            result.cycles = cycles;
+        }
+        result.tokens = tokens;
+        result.allocations = allocationCount.load(std::memory_order_relaxed) - allocationsBefore;
+    }
+    result.peakRssKb = peakRssKb();
+    return result;
+}
+
+struct Engine {
+    const char* name;
+    size_t (*run)(std::string_view source);
+};
+
+const Engine engines[] = {
+    {"lexer", [](std::string_view source) { return handwritten::Lexer(source).analyze().size(); }},
+    {"automaton", [](std::string_view source) { return automaton::LexerFiniteAutomaton(source).analyze().size(); }},
+    {"automaton-reference", [](std::string_view source) { return automaton::LexerFiniteAutomaton(source).analyzeReference().size(); }},
+    {"lexer-buffer", [](std::string_view source) {
+        TokenBuffer tokens;
+        handwritten::Lexer(source).analyzeInto(tokens);
+        return tokens.size();
+    }},
+    {"automaton-buffer", [](std::string_view source) {
+        TokenBuffer tokens;
+        automaton::LexerFiniteAutomaton(source).analyzeInto(tokens);
+        return tokens.size();
+    }},
+    // Tokens loaded from a token cache instead of lexed. The cache is encoded on the first
+    // run over each input, which best-of-reps timing leaves out when --reps is above 1.
+    {"lexer-cache", [](std::string_view source) {
+        static std::string encoded;
+        static std::string_view encodedFor;
+        if (encodedFor.data() != source.data() || encodedFor.size() != source.size()) {
+            encoded = handwritten::encodeTokenCache(source, handwritten::Lexer(source).analyze());
+            encodedFor = source;
+        }
+        handwritten::TokenCache cache;
+        std::vector<TokenView> tokens;
+        if (!cache.load(encoded) || !cache.matches(source) || !cache.decode(source, tokens)) return size_t(0);
+        return tokens.size();
+    }},
+    // Lexing followed by printing, as the lexer program does, against the same printing
+    // overlapped with lexing on another thread. Output goes to /dev/null.
+    {"lexer-print", [](std::string_view source) {
+        static const int devNull = ::open("/dev/null", O_WRONLY);
+        TokenWriter writer(devNull);
+        std::vector<TokenView> tokens = handwritten::Lexer(source).analyze();
+        handwritten::printTokens(tokens, writer);
+        return tokens.size();
+    }},
+    {"lexer-pipelined-print", [](std::string_view source) {
+        static const int devNull = ::open("/dev/null", O_WRONLY);
+        TokenWriter writer(devNull);
+        size_t tokens = 0;
+        handwritten::lexPipelined(source, [&](const TokenView& token) {
+            writer.write(token);
+            tokens++;
+        });
+        return tokens;
+    }},
+};
+
+// Snippet engines lex an input as many small pieces, the way a service sees it. "fresh" is
+// the per-call setup a caller without a session pays: a copy of the snippet and a new vector.
+struct SnippetEngine {
+    const char* name;
+    size_t (*run)(const std::vector<std::string_view>& snippets);
+};
+
+const SnippetEngine snippetEngines[] = {
+    {"lexer-fresh", [](const std::vector<std::string_view>& snippets) {
+        size_t tokens = 0;
+        for (std::string_view snippet : snippets) {
+            std::string source(snippet);
+            tokens += handwritten::Lexer(source).analyze().size();
+        }
+        return tokens;
+    }},
+    {"lexer-session", [](const std::vector<std::string_view>& snippets) {
+        handwritten::LexerSession session;
+        size_t tokens = 0;
+        for (std::string_view snippet : snippets) tokens += session.analyze(snippet).size();
+        return tokens;
+    }},
+    {"automaton-fresh", [](const std::vector<std::string_view>& snippets) {
+        size_t tokens = 0;
+        for (std::string_view snippet : snippets) {
+            std::string source(snippet);
+            tokens += automaton::LexerFiniteAutomaton(source).analyze().size();
+        }
+        return tokens;
+    }},
+    {"automaton-session", [](const std::vector<std::string_view>& snippets) {
+        automaton::LexerSession session;
+        size_t tokens = 0;
+        for (std::string_view snippet : snippets) tokens += session.analyze(snippet).size();
+        return tokens;
+    }},
+};
+
+// Cuts `source` after the first newline at or past every `size` bytes.
+std::vector<std::string_view> splitSnippets(std::string_view source, size_t size) {
+    std::vector<std::string_view> snippets;
+    size_t start = 0;
+    while (start < source.size()) {
+        size_t newline = source.find('\n', std::min(start + size, source.size()) - 1);
+        size_t end = newline == std::string_view::npos ? source.size() : newline + 1;
+        snippets.push_back(source.substr(start, end - start));
+        start = end;
+    }
+    return snippets;
+}
+
+// One TSV row per engine and corpus, under a header row.
+void writeRow(const std::string& corpus, const char* engine, size_t bytes, const BenchResult& result) {
+    double megabytes = bytes / 1e6;
+    std::printf("%s\t%s\t%zu\t%zu\t%.6f\t%.2f\t%.0f\t%.4f\t%ld\t%.3f\n", engine, corpus.c_str(), bytes,
+                result.tokens, result.seconds, megabytes / result.seconds, result.tokens / result.seconds,
+                result.tokens ? static_cast<double>(result.allocations) / result.tokens : 0.0, result.peakRssKb,
+                bytes ? static_cast<double>(result.cycles) / bytes : 0.0);
+}
+
+bool readFile(const std::string& path, std::string& data) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::stringstream contents;
+    contents << in.rdbuf();
+    data = contents.str();
+    return true;
+}
+
+// Usage: bench [--size=MB] [--reps=N] [--snippet=BYTES] [--corpus=NAME]... [--engine=NAME]... [FILE]...
+// Generates each corpus (all of them by default) at the given size, or reads the FILEs, and
+// prints one TSV row per engine and input. Each input is also lexed as snippets of about
+// BYTES (256 by default, 0 to skip) on the snippet engines. Built like the lexers themselves:
+//   g++ -std=c++17 -O2 bench/main.cpp -o lexer-bench
+int main(int argc, char* argv[]) {
+    size_t megabytes = 8;
+    int repetitions = 5;
+    size_t snippetSize = 256;
+    std::string writeDir;
+    std::vector<std::string> profileNames;
+    std::vector<std::string> files;
+    std::vector<std::string> engineNames;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--size=", 0) == 0) megabytes = std::strtoull(arg.c_str() + 7, nullptr, 10);
+        else if (arg.rfind("--reps=", 0) == 0) repetitions = std::max(1, std::atoi(arg.c_str() + 7));
+        else if (arg.rfind("--corpus=", 0) == 0) profileNames.push_back(arg.substr(9));
+        else if (arg.rfind("--engine=", 0) == 0) engineNames.push_back(arg.substr(9));
+        else if (arg.rfind("--write-corpus=", 0) == 0) writeDir = arg.substr(15);
+        else if (arg.rfind("--snippet=", 0) == 0) snippetSize = std::strtoull(arg.c_str() + 10, nullptr, 10);
+        else files.push_back(arg);
+    }
+    if (profileNames.empty() && files.empty()) {
+        for (const auto& profile : CorpusGenerator::profiles) profileNames.push_back(profile.name);
+    }
+
+    std::vector<std::pair<std::string, std::string>> corpora;
+    for (const auto& name : profileNames) {
+        const CorpusGenerator::Profile* profile = CorpusGenerator::findProfile(name);
+        if (!profile) {
+            std::cerr << "Error: Unknown corpus " << name << " (expected mixed, identifiers, comments, strings, numbers or unicode)" << std::endl;
+            return 1;
+        }
+        corpora.emplace_back(name, CorpusGenerator().generate(*profile, megabytes << 20));
+    }
+    for (const auto& path : files) {
+        std::string data;
+        if (!readFile(path, data)) {
+            std::cerr << "Error: Unable to open " << path << std::endl;
+            return 1;
+        }
+        corpora.emplace_back(path, std::move(data));
+    }
+
+    // With --write-corpus the generated inputs are saved as DIR/<name>.rb for the lexer
+    // programs themselves (e.g. their --batch mode) and nothing is measured.
+    if (!writeDir.empty()) {
+        for (const auto& [name, data] : corpora) {
+            std::string path = writeDir + "/" + name + ".rb";
+            std::ofstream out(path, std::ios::binary);
+            if (!out.write(data.data(), data.size())) {
+                std::cerr << "Error: Unable to write " << path << std::endl;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    std::printf("engine\tcorpus\tbytes\ttokens\tseconds\tmb_per_s\ttokens_per_s\tallocs_per_token\tpeak_rss_kb\tcycles_per_byte\n");
+    auto selected = [&](const char* engine) {
+        return engineNames.empty() || std::find(engineNames.begin(), engineNames.end(), engine) != engineNames.end();
+    };
+    for (const auto& [name, data] : corpora) {
+        for (const Engine& engine : engines) {
+            if (!selected(engine.name)) continue;
+            std::string_view source = data;
+            writeRow(name, engine.name, data.size(), measure(repetitions, [&] { return engine.run(source); }));
+            std::fflush(stdout);
+        }
+        if (snippetSize == 0) continue;
+        std::vector<std::string_view> snippets = splitSnippets(data, snippetSize);
+        for (const SnippetEngine& engine : snippetEngines) {
+            if (!selected(engine.name)) continue;
+            writeRow(name + "/snippets", engine.name, data.size(), measure(repetitions, [&] { return engine.run(snippets); }));
+            std::fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,1554 @@
+// The hand-written lexer and what is built on it: token caches, the definition index,
+// streaming, incremental and pipelined lexing, and token search.
+#pragma once
+
+#include "lexer_common.h"
+
+namespace handwritten {
+
+// Token sink that counts every token into a LexerStats on its way to another sink.
+template <typename Tokens>
+struct StatsSink {
+    Tokens& tokens;
+    LexerStats& stats;
+
+    void push_back(const TokenView& token) {
+        stats.recordToken(token.type, token.lexeme.size());
+        tokens.push_back(token);
+    }
+};
+
+// Token sink that feeds every token to a BlockIndex on its way to another sink.
+template <typename Tokens>
+struct BlockSink {
+    Tokens& tokens;
+    BlockIndex& blocks;
+
+    void push_back(const TokenView& token) {
+        blocks.add(token);
+        tokens.push_back(token);
+    }
+};
+
+// Token vector that sets each token's line from a LineIndex built before the scan, so the
+// scan itself skips counting newlines. Tokens must come in source order, as a sequential
+// scan produces them; END_OF_FILE goes on the last line.
+struct LineIndexedTokens {
+    LineIndexedTokens(std::vector<TokenView>& tokens, std::string_view source)
+        : tokens(tokens), source(source), lines(source), nextStart(lineStartAfter(1)) {}
+
+    void push_back(const TokenView& token) {
+        size_t offset = token.type == TokenType::END_OF_FILE ? source.size() : token.lexeme.data() - source.data();
+        while (offset >= nextStart) nextStart = lineStartAfter(++line);
+        tokens.push_back(token);
+        tokens.back().line = line;
+    }
+
+private:
+    std::vector<TokenView>& tokens;
+    std::string_view source;
+    LineIndex lines;
+    int line = 1;
+    size_t nextStart;
+
+    size_t lineStartAfter(int at) const {
+        return static_cast<size_t>(at) < lines.lineCount() ? lines.lineStart(at + 1) : SIZE_MAX;
+    }
+};
+
+// Whether lexing into `Tokens` can leave lines unset: a TokenBuffer looks them up in its
+// LineIndex, and a LineIndexedTokens sets them itself. Sinks that pass tokens on need
+// lines exactly when what they feed does.
+template <typename Tokens>
+constexpr bool linesFromIndex = std::is_same_v<Tokens, TokenBuffer> || std::is_same_v<Tokens, LineIndexedTokens>;
+template <typename Tokens>
+constexpr bool linesFromIndex<StatsSink<Tokens>> = linesFromIndex<Tokens>;
+template <typename Tokens>
+constexpr bool linesFromIndex<BlockSink<Tokens>> = linesFromIndex<Tokens>;
+
+class Lexer {
+public:
+    // The lexer does not copy the source; tokens it returns point into it.
+    Lexer(std::string_view source) : source(source), current(0), line(1) {}
+
+    std::vector<TokenView> analyze() {
+        std::vector<TokenView> tokens;
+        LineIndexedTokens sink{tokens, source};
+        scanAll(sink);
+        return tokens;
+    }
+
+    // Same tokens as analyze(), stored column-wise in `tokens`, which is reset for this source
+    // and pre-sized from an estimate of the token count.
+    void analyzeInto(TokenBuffer& tokens) {
+        tokens.reset(source);
+        scanAll(tokens);
+    }
+
+    // analyzeInto() that also counts every token into `stats`.
+    void analyzeInto(TokenBuffer& tokens, LexerStats& stats) {
+        tokens.reset(source);
+        StatsSink<TokenBuffer> sink{tokens, stats};
+        scanAll(sink);
+    }
+
+    // analyze() and analyzeInto() that also match blocks and brackets into `blocks`, which is
+    // reset for this source, as the tokens are produced.
+    std::vector<TokenView> analyze(BlockIndex& blocks) {
+        std::vector<TokenView> tokens;
+        LineIndexedTokens indexed{tokens, source};
+        blocks.reset(source);
+        BlockSink<LineIndexedTokens> sink{indexed, blocks};
+        scanAll(sink);
+        return tokens;
+    }
+
+    void analyzeInto(TokenBuffer& tokens, BlockIndex& blocks) {
+        tokens.reset(source);
+        blocks.reset(source);
+        BlockSink<TokenBuffer> sink{tokens, blocks};
+        scanAll(sink);
+    }
+
+    // Hands the tokens analyze() would return, in order, to any sink with
+    // push_back(const TokenView&), such as a TokenRing another thread is reading.
+    template <typename Sink>
+    void analyzeTo(Sink& sink) {
+        scanAll(sink);
+    }
+
+    // Same result as analyze(), computed by lexing newline-aligned chunks on separate threads.
+    // Inputs shorter than two chunks of `minChunk` bytes are lexed sequentially.
+    std::vector<TokenView> analyzeParallel(unsigned threads, size_t minChunk = PARALLEL_MIN_CHUNK) {
+        size_t chunkCount = std::min<size_t>(threads, source.size() / std::max<size_t>(minChunk, 1));
+        if (chunkCount < 2) return analyze();
+
+        // Chunks start just after a newline. Nothing but strings and heredocs carries over a
+        // newline, so a chunk lexed as if it began a line in plain code is right unless the
+        // previous chunk's last token runs past it or leaves a string, interpolation or
+        // heredoc open; stitch() catches and re-lexes those cases.
+        std::vector<int> bounds = {0};
+        for (size_t k = 1; k < chunkCount; k++) {
+            size_t target = std::max<size_t>(source.size() * k / chunkCount, bounds.back());
+            size_t newline = source.find('\n', target);
+            if (newline == std::string_view::npos || newline + 1 >= source.size()) break;
+            if (static_cast<int>(newline + 1) > bounds.back()) bounds.push_back(newline + 1);
+        }
+        bounds.push_back(source.size());
+
+        validatedUtf8 = kernels.validUtf8(source.data(), source.data() + source.size());
+        std::vector<ChunkResult> chunks(bounds.size() - 1);
+        std::vector<std::thread> workers;
+        for (size_t k = 0; k < chunks.size(); k++) {
+            workers.emplace_back([this, &chunks, &bounds, k] {
+                Lexer chunkLexer(source);
+                chunkLexer.validatedUtf8 = validatedUtf8;
+                chunks[k] = chunkLexer.analyzeRange(bounds[k], bounds[k + 1]);
+                chunks[k].newlines = std::count(source.begin() + bounds[k], source.begin() + bounds[k + 1], '\n');
+            });
+        }
+        for (auto& worker : workers) worker.join();
+
+        return stitch(chunks, bounds);
+    }
+
+    static constexpr size_t PARALLEL_MIN_CHUNK = 1 << 20;
+
+private:
+    friend class StreamScanner;
+    friend class IncrementalLexer;
+
+    // Tokens of one chunk with lines counted from 1 at the chunk start, which of them the
+    // lexer was not settled before (see scanStepRecorded()), where scanning stopped and in
+    // which mode, and how many newlines the chunk's own bytes hold.
+    struct ChunkResult {
+        std::vector<TokenView> tokens;
+        std::vector<uint8_t> unsettled;
+        LexModes modes;
+        int end = 0;
+        int newlines = 0;
+    };
+
+    // Lexes from `from` on line 1, in plain code, until a token would start at or after
+    // `to`. The last token may run past `to`.
+    ChunkResult analyzeRange(int from, int to) {
+        ChunkResult result;
+        current = from;
+        line = 1;
+        while (!isAtEnd() && current < to) scanStepRecorded(result.tokens, result.unsettled);
+        result.end = current;
+        result.modes = modes;
+        return result;
+    }
+
+    // analyze() that also flags each token, END_OF_FILE included, that the lexer was not
+    // settled before (see scanStepRecorded()).
+    std::vector<TokenView> analyzeRecorded(std::vector<uint8_t>& unsettled) {
+        std::vector<TokenView> tokens;
+        validatedUtf8 = kernels.validUtf8(source.data(), source.data() + source.size());
+        while (!isAtEnd()) scanStepRecorded(tokens, unsettled);
+        unsettled.push_back(!modes.settledAt(current));
+        tokens.push_back({TokenType::END_OF_FILE, "", line});
+        return tokens;
+    }
+
+    std::vector<TokenView> stitch(std::vector<ChunkResult>& chunks, const std::vector<int>& bounds) {
+        size_t total = 0;
+        for (const auto& chunk : chunks) total += chunk.tokens.size();
+        std::vector<TokenView> tokens;
+        tokens.reserve(total + 1);
+
+        auto offsetOf = [this](const TokenView& token) { return static_cast<int>(token.lexeme.data() - source.data()); };
+        auto append = [&tokens](auto first, auto last, int lineBase) {
+            for (; first != last; ++first) {
+                tokens.push_back(*first);
+                tokens.back().line += lineBase;
+            }
+        };
+
+        int reached = 0;       // where a sequential lexer would call scanStep() next
+        LexModes modes;        // and the mode it would be in there
+        int linesBefore = 0;   // newlines in [0, bounds[k])
+        for (size_t k = 0; k < chunks.size(); k++) {
+            ChunkResult& chunk = chunks[k];
+            if (reached == bounds[k] && modes.topLevel()) {
+                append(chunk.tokens.begin(), chunk.tokens.end(), linesBefore);
+                reached = chunk.end;
+                modes = chunk.modes;
+                linesBefore += chunk.newlines;
+                continue;
+            }
+
+            // The previous token ended inside this chunk, or left a string or heredoc open.
+            // Re-lex from there until scanning lands, in plain code, on a position where the
+            // speculative pass also started a token in plain code; from that point on both
+            // passes are in the same state and the rest of the chunk is reused.
+            Lexer relexer(source);
+            relexer.validatedUtf8 = validatedUtf8;
+            relexer.current = reached;
+            relexer.modes = std::move(modes);
+            int lineBase = linesBefore + static_cast<int>(std::count(source.begin() + bounds[k], source.begin() + reached, '\n'));
+            std::vector<TokenView> relexed;
+            size_t spec = 0;
+            bool synced = false;
+            while (!relexer.isAtEnd() && relexer.current < bounds[k + 1]) {
+                while (spec < chunk.tokens.size() && offsetOf(chunk.tokens[spec]) < relexer.current) spec++;
+                if (spec < chunk.tokens.size() && offsetOf(chunk.tokens[spec]) == relexer.current &&
+                    relexer.modes.topLevel() && !chunk.unsettled[spec]) {
+                    synced = true;
+                    break;
+                }
+                relexer.scanStep(relexed);
+            }
+            append(relexed.begin(), relexed.end(), lineBase);
+            if (synced) {
+                append(chunk.tokens.begin() + spec, chunk.tokens.end(), linesBefore);
+                reached = chunk.end;
+                modes = std::move(chunk.modes);
+            } else {
+                reached = relexer.current;
+                modes = std::move(relexer.modes);
+            }
+            linesBefore += chunk.newlines;
+        }
+
+        int lastLine = linesBefore + 1;
+        tokens.push_back({TokenType::END_OF_FILE, "", lastLine});
+        return tokens;
+    }
+
+    std::string_view source;
+    int start = 0;
+    int current = 0;
+    int line = 1;
+    bool validatedUtf8 = false;   // set once the whole source is known to be well-formed UTF-8
+    LexModes modes;
+
+    template <typename Tokens>
+    static constexpr bool countsLines = !linesFromIndex<Tokens>;
+
+    template <typename Tokens>
+    void scanAll(Tokens& tokens) {
+        validatedUtf8 = kernels.validUtf8(source.data(), source.data() + source.size());
+        while (!isAtEnd()) scanStep(tokens);
+        tokens.push_back({TokenType::END_OF_FILE, "", line});
+    }
+
+    // Lexes one token, or one run of whitespace, from `current`: code through scanToken(),
+    // strings and heredoc bodies a fragment at a time.
+    template <typename Tokens>
+    void scanStep(Tokens& tokens) {
+        start = current;
+        if (modes.inCode()) {
+            char c = advance();
+            scanToken(c, tokens);
+        } else {
+            addMultilineToken(scanStringMode(source, start, current, modes, kernels), tokens);
+        }
+    }
+
+    // scanStep() that flags, in `unsettled`, a token the lexer could not have started at
+    // from scratch: one inside a string, interpolation or heredoc body, after a heredoc
+    // opener on the same line, or over bytes an earlier heredoc scan already read.
+    template <typename Tokens>
+    void scanStepRecorded(Tokens& tokens, std::vector<uint8_t>& unsettled) {
+        bool settled = modes.settledAt(current);
+        scanStep(tokens);
+        unsettled.resize(tokens.size(), !settled);
+    }
+
+    const ScanKernels& kernels = ScanKernels::best();
+
+    bool isAtEnd() { return current >= source.length(); }
+    char advance() { return source[current++]; }
+    char peek() { if (isAtEnd()) return '\0'; return source[current]; }
+    char peekNext() { if (current + 1 >= source.length()) return '\0'; return source[current + 1]; }
+    bool match(char expected) {
+        if (isAtEnd() || source[current] != expected) return false;
+        current++;
+        return true;
+    }
+    
+    void skipIdentifierChars() {
+        current = kernels.identifierEnd(source.data() + current, source.data() + source.size()) - source.data();
+    }
+
+    template <typename Tokens>
+    void addToken(TokenType type, Tokens& tokens) {
+        tokens.push_back({type, source.substr(start, current - start), line});
+    }
+
+    // A token is on the line it starts on; the newlines inside it count from the next token.
+    template <typename Tokens>
+    void addMultilineToken(TokenType type, Tokens& tokens) {
+        addToken(type, tokens);
+        if constexpr (countsLines<Tokens>) line += std::count(source.begin() + start, source.begin() + current, '\n');
+    }
+
+    // Names take any non-ASCII bytes; one whose bytes are not well-formed UTF-8 is UNKNOWN.
+    // Once the whole source has passed validation no name needs checking on its own.
+    template <typename Tokens>
+    void addWord(TokenType type, Tokens& tokens) {
+        if (!validatedUtf8 && !isWellFormedUtf8(source.substr(start, current - start))) type = TokenType::UNKNOWN;
+        addToken(type, tokens);
+    }
+
+    template <typename Tokens>
+    void scanToken(char c, Tokens& tokens) {
+        switch (c) {
+            case '(': case ')': case '[': case ']': case ',': case ';':
+                addToken(TokenType::SEPARATOR, tokens);
+                break;
+
+            case '{': case '}':
+                addToken(braceType(c, modes), tokens);
+                break;
+
+            case '!': case '=': case '<': case '>': case '+': case '-': case '*': case '/':
+            case '%': case '&': case '|': case '^': case '~': case '?':
+                scanOperator(tokens);
+                break;
+
+            case '#':
+                current = kernels.findFirstOf(source.data() + current, source.data() + source.size(), '\n', '\n', '\n') - source.data();
+                addToken(TokenType::COMMENT, tokens);
+                break;
+
+            case '.':
+                if (match('.')) {
+                    addToken(match('.') ? TokenType::RANGE_EXCLUSIVE : TokenType::RANGE_INCLUSIVE, tokens);
+                } else {
+                    scanOperator(tokens);
+                }
+                break;
+            
+            case ':':
+                if (isWordStartByte(peek())) {
+                    advance(); 
+                    skipIdentifierChars();
+                    addWord(TokenType::SYMBOL, tokens);
+                } else {
+                    scanOperator(tokens);
+                }
+                break;
+            
+            case '"': case '\'':
+                addMultilineToken(scanQuotedString(source, start, current, modes, kernels), tokens);
+                break;
+
+            case ' ': case '\r': case '\t': break;
+            case '\n':
+                if constexpr (countsLines<Tokens>) line++;
+                if (!modes.pending.empty()) modes.beginHeredocBody();
+                break;
+
+            default:
+                if (isDigitByte(c)) {
+                    scanNumber(tokens);
+                } else if (isWordStartByte(c)) {
+                    scanIdentifier(tokens);
+                } else if (c == '@' || c == '$') {
+                    scanPrefixedIdentifier(tokens);
+                }
+                else {
+                    addToken(TokenType::UNKNOWN, tokens);
+                }
+                break;
+        }
+    }
+
+    template <typename Tokens>
+    void scanNumber(Tokens& tokens) {
+        NumberLiteral literal = scanNumberLiteral(source.substr(start));
+        current = start + literal.length;
+        tokens.push_back({literal.type, source.substr(start, current - start), line, Keyword::NOT_KEYWORD,
+                          Operator::NOT_OPERATOR, literal.bigInteger, literal.value});
+    }
+
+    // The first byte is already consumed; the trie decides how many more belong to the operator.
+    template <typename Tokens>
+    void scanOperator(Tokens& tokens) {
+        if (source[start] == '<') {
+            if (size_t length = scanHeredocStart(source, start, modes)) {
+                current = start + length;
+                addToken(TokenType::HEREDOC_BEGIN, tokens);
+                return;
+            }
+        }
+        OperatorMatch match = matchOperator(source.substr(start));
+        current = start + match.length;
+        tokens.push_back({TokenType::OPERATOR, source.substr(start, current - start), line, Keyword::NOT_KEYWORD, match.op});
+    }
+
+    template <typename Tokens>
+    void scanIdentifier(Tokens& tokens) {
+        current--;
+        
+        skipIdentifierChars();
+        if (startsUppercase(source.substr(start, current - start))) {
+            addWord(TokenType::CONSTANT, tokens);
+            return;
+        }
+        Keyword keyword = classifyKeyword(source.substr(start, current - start));
+        // A trailing '?' is part of the word only when it completes a keyword (defined?).
+        if (keyword == Keyword::NOT_KEYWORD && peek() == '?') {
+            keyword = classifyKeyword(source.substr(start, current - start + 1));
+            if (keyword != Keyword::NOT_KEYWORD) advance();
+        }
+        if (keyword != Keyword::NOT_KEYWORD) {
+            tokens.push_back({TokenType::KEYWORD, source.substr(start, current - start), line, keyword});
+        } else {
+            addWord(TokenType::IDENTIFIER_LOCAL, tokens);
+        }
+    }
+    
+    template <typename Tokens>
+    void scanPrefixedIdentifier(Tokens& tokens) {
+        char prefix = source[start];
+        TokenType type;
+        if (prefix == '$') {
+            type = TokenType::IDENTIFIER_GLOBAL;
+        } else if (prefix == '@') {
+            type = match('@') ? TokenType::IDENTIFIER_CLASS : TokenType::IDENTIFIER_INSTANCE;
+        } else {
+            addToken(TokenType::UNKNOWN, tokens); 
+            return;
+        }
+        
+        if (isWordStartByte(peek())) {
+             skipIdentifierChars();
+             addWord(type, tokens);
+        } else {
+             addToken(TokenType::OPERATOR, tokens);
+        }
+    }
+};
+
+// Bumped whenever a change to Lexer can change the tokens it produces, so token caches
+// written by an older lexer are ignored instead of trusted.
+constexpr uint16_t LEXER_VERSION = 6;
+
+// 64-bit hash of a source buffer, eight bytes per step, used to tell whether a token cache
+// still belongs to the file next to it.
+inline uint64_t hashSource(std::string_view data) {
+    const uint64_t multiplier = 0xff51afd7ed558ccdull;
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ data.size();
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t word;
+        memcpy(&word, data.data() + i, 8);
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 29;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data.data() + i, data.size() - i);
+    hash = (hash ^ tail) * multiplier;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// On-disk token cache. After the header come six columns: one type byte per token; one
+// detail byte per token (the Keyword or Operator id, or 1 for a big integer); the 8-byte
+// NumberValue of each NUMBER_* token; then LEB128 varints for the offset delta from the
+// previous token, the lexeme length, and the line delta from the previous token. Lexemes
+// are not stored; they are slices of the source the cache was built from. Integers are in
+// native byte order.
+struct TokenCacheHeader {
+    char magic[4];
+    uint16_t formatVersion;
+    uint16_t lexerVersion;
+    uint64_t sourceHash;
+    uint64_t sourceSize;
+    uint32_t tokenCount;
+    uint32_t numberCount;
+    uint32_t offsetBytes;
+    uint32_t lengthBytes;
+    uint32_t lineBytes;
+    uint32_t reserved;   // zero; keeps the header free of padding
+};
+
+constexpr char TOKEN_CACHE_MAGIC[4] = {'R', 'T', 'O', 'K'};
+constexpr uint16_t TOKEN_CACHE_FORMAT = 2;
+
+inline void appendVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+inline bool readVarint(const unsigned char*& p, const unsigned char* end, uint64_t& value) {
+    if (p < end && *p < 0x80) {
+        value = *p++;
+        return true;
+    }
+    value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char byte = *p++;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Serializes `tokens`, which must have been lexed from `source`. The END_OF_FILE token
+// is stored as an empty lexeme at the end of the source.
+inline std::string encodeTokenCache(std::string_view source, const std::vector<TokenView>& tokens) {
+    std::string types, details, numbers, offsets, lengths, lines;
+    types.reserve(tokens.size());
+    details.reserve(tokens.size());
+    offsets.reserve(tokens.size() * 2);
+    lengths.reserve(tokens.size());
+    lines.reserve(tokens.size());
+
+    uint64_t previousOffset = 0;
+    int previousLine = 1;
+    for (const auto& token : tokens) {
+        bool inSource = token.lexeme.data() >= source.data() && token.lexeme.data() <= source.data() + source.size();
+        uint64_t offset = inSource ? token.lexeme.data() - source.data() : source.size();
+        types += static_cast<char>(token.type);
+        details += static_cast<char>(tokenDetail(token));
+        if (isNumberType(token.type)) numbers.append(reinterpret_cast<const char*>(&token.number), sizeof(token.number));
+        appendVarint(offsets, offset - previousOffset);
+        appendVarint(lengths, token.lexeme.size());
+        appendVarint(lines, token.line - previousLine);
+        previousOffset = offset;
+        previousLine = token.line;
+    }
+
+    TokenCacheHeader header{};
+    memcpy(header.magic, TOKEN_CACHE_MAGIC, sizeof(header.magic));
+    header.formatVersion = TOKEN_CACHE_FORMAT;
+    header.lexerVersion = LEXER_VERSION;
+    header.sourceHash = hashSource(source);
+    header.sourceSize = source.size();
+    header.tokenCount = tokens.size();
+    header.numberCount = numbers.size() / sizeof(NumberValue);
+    header.offsetBytes = offsets.size();
+    header.lengthBytes = lengths.size();
+    header.lineBytes = lines.size();
+
+    std::string out(reinterpret_cast<const char*>(&header), sizeof(header));
+    out += types;
+    out += details;
+    out += numbers;
+    out += offsets;
+    out += lengths;
+    out += lines;
+    return out;
+}
+
+// Writes `data` to a temporary file and renames it over `path`, so a reader never maps a
+// half-written file.
+inline bool writeFileAtomically(const std::string& path, std::string_view data) {
+    std::string temporary = path + ".tmp";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    const char* p = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+        ssize_t n = ::write(fd, p, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        p += n;
+        left -= n;
+    }
+    bool ok = ::close(fd) == 0 && left == 0;
+    if (ok) ok = rename(temporary.c_str(), path.c_str()) == 0;
+    if (!ok) unlink(temporary.c_str());
+    return ok;
+}
+
+inline bool writeTokenCache(const std::string& path, std::string_view source, const std::vector<TokenView>& tokens) {
+    return writeFileAtomically(path, encodeTokenCache(source, tokens));
+}
+
+// Memory-mapped token cache. The type column is used in place; the other columns are
+// decoded on load into views of the caller's source, without lexing anything again.
+class TokenCache {
+public:
+    // Maps `path` and checks that its columns fit in the file.
+    bool open(const std::string& path) {
+        return file.open(path) && load(file.view());
+    }
+
+    // Uses an already encoded cache in memory, which must outlive this object.
+    bool load(std::string_view data) {
+        columns = nullptr;
+        if (data.size() < sizeof(header)) return false;
+        memcpy(&header, data.data(), sizeof(header));
+        if (memcmp(header.magic, TOKEN_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.formatVersion != TOKEN_CACHE_FORMAT) return false;
+        uint64_t expected = sizeof(header) + 2 * uint64_t(header.tokenCount) + uint64_t(header.numberCount) * sizeof(NumberValue)
+                          + header.offsetBytes + header.lengthBytes + header.lineBytes;
+        if (expected != data.size()) return false;
+        columns = reinterpret_cast<const unsigned char*>(data.data()) + sizeof(header);
+        return true;
+    }
+
+    // Whether the cache was written by this lexer for exactly these bytes.
+    bool matches(std::string_view source) const {
+        return columns && header.lexerVersion == LEXER_VERSION && header.sourceSize == source.size() && header.sourceHash == hashSource(source);
+    }
+
+    size_t size() const { return columns ? header.tokenCount : 0; }
+    const TokenType* types() const { return reinterpret_cast<const TokenType*>(columns); }
+
+    // Decodes tokens one at a time over `source`, straight from the mapped columns.
+    class Cursor {
+    public:
+        Cursor(const TokenCache& cache, std::string_view source) : source(source), remaining(cache.size()) {
+            if (!cache.columns) return;
+            types = cache.columns;
+            details = types + cache.header.tokenCount;
+            numbers = details + cache.header.tokenCount;
+            numberEnd = offsets = numbers + cache.header.numberCount * sizeof(NumberValue);
+            offsetEnd = lengths = offsets + cache.header.offsetBytes;
+            lengthEnd = lines = lengths + cache.header.lengthBytes;
+            lineEnd = lines + cache.header.lineBytes;
+        }
+
+        // False at the end, or with `corrupt` set when the columns do not decode.
+        bool next(TokenView& token) {
+            if (remaining == 0 || corrupt) return false;
+            uint64_t offsetDelta, length, lineDelta;
+            if (!readVarint(offsets, offsetEnd, offsetDelta) || !readVarint(lengths, lengthEnd, length)
+                || !readVarint(lines, lineEnd, lineDelta)) return fail();
+            offset += offsetDelta;
+            line += lineDelta;
+            uint8_t type = *types++;
+            uint8_t detail = *details++;
+            if (type > static_cast<uint8_t>(TokenType::END_OF_FILE) || offset > source.size() || length > source.size() - offset) return fail();
+
+            token.type = static_cast<TokenType>(type);
+            token.lexeme = token.type == TokenType::END_OF_FILE ? std::string_view("") : source.substr(offset, length);
+            token.line = static_cast<int>(line);
+            token.keyword = Keyword::NOT_KEYWORD;
+            token.op = Operator::NOT_OPERATOR;
+            token.bigInteger = false;
+            token.number = {};
+            if (token.type == TokenType::KEYWORD) {
+                if (detail >= KEYWORD_COUNT) return fail();
+                token.keyword = static_cast<Keyword>(detail);
+            } else if (token.type == TokenType::OPERATOR) {
+                if (detail >= OPERATOR_COUNT) return fail();
+                token.op = static_cast<Operator>(detail);
+            } else if (isNumberType(token.type)) {
+                if (numberEnd - numbers < static_cast<ptrdiff_t>(sizeof(NumberValue))) return fail();
+                memcpy(&token.number, numbers, sizeof(NumberValue));
+                numbers += sizeof(NumberValue);
+                token.bigInteger = detail != 0;
+            }
+            remaining--;
+            return true;
+        }
+
+        // After the last token: whether every column was consumed exactly.
+        bool complete() const {
+            return !corrupt && remaining == 0 && numbers == numberEnd && offsets == offsetEnd && lengths == lengthEnd && lines == lineEnd;
+        }
+
+    private:
+        std::string_view source;
+        size_t remaining;
+        const unsigned char* types = nullptr;
+        const unsigned char* details = nullptr;
+        const unsigned char* numbers = nullptr;
+        const unsigned char* numberEnd = nullptr;
+        const unsigned char* offsets = nullptr;
+        const unsigned char* offsetEnd = nullptr;
+        const unsigned char* lengths = nullptr;
+        const unsigned char* lengthEnd = nullptr;
+        const unsigned char* lines = nullptr;
+        const unsigned char* lineEnd = nullptr;
+        uint64_t offset = 0;
+        uint64_t line = 1;
+        bool corrupt = false;
+
+        bool fail() {
+            corrupt = true;
+            return false;
+        }
+    };
+
+    // Rebuilds the whole token vector over `source`. Fails on a corrupt cache.
+    bool decode(std::string_view source, std::vector<TokenView>& tokens) const {
+        tokens.resize(size(), {TokenType::END_OF_FILE, "", 0});
+        Cursor cursor(*this, source);
+        for (auto& token : tokens) {
+            if (!cursor.next(token)) return false;
+        }
+        return cursor.complete();
+    }
+
+private:
+    SourceFile file;
+    TokenCacheHeader header{};
+    const unsigned char* columns = nullptr;
+};
+
+enum class DefinitionKind : uint8_t {
+    CLASS, MODULE, METHOD, SINGLETON_METHOD,
+    INSTANCE_VARIABLE, CLASS_VARIABLE, GLOBAL_VARIABLE, CONSTANT
+};
+
+constexpr std::string_view definitionKindNames[] = {
+    "class", "module", "method", "singleton method",
+    "instance variable", "class variable", "global variable", "constant"
+};
+
+constexpr size_t DEFINITION_KIND_COUNT = std::size(definitionKindNames);
+
+// One definition as stored, in memory and on disk: offsets into a string table, an index
+// into the file table and the line.
+struct DefinitionRecord {
+    uint32_t name;
+    uint32_t scope;
+    uint32_t file;
+    uint32_t line;
+    uint16_t nameLength;
+    uint16_t scopeLength;
+    uint8_t kind;
+    uint8_t reserved[3];
+};
+
+// Definition index file: the header, then the records sorted by name, then one
+// (offset, length) pair per file path, then the string table all of them point into.
+struct DefinitionIndexHeader {
+    char magic[4];
+    uint16_t formatVersion;
+    uint16_t lexerVersion;
+    uint32_t definitionCount;
+    uint32_t fileCount;
+    uint32_t stringBytes;
+    uint32_t reserved;
+};
+
+constexpr char DEFINITION_INDEX_MAGIC[4] = {'R', 'D', 'E', 'F'};
+constexpr uint16_t DEFINITION_INDEX_FORMAT = 2;
+
+struct Definition {
+    std::string_view name;
+    std::string_view scope;   // enclosing classes and modules, "A::B"; empty at top level
+    std::string_view path;
+    uint32_t line;
+    DefinitionKind kind;
+};
+
+class DefinitionFile;
+
+// Classes, modules, methods, and assignments to instance, class and global variables and
+// constants, found in one pass over each file's tokens. Blocks are tracked with a
+// BlockIndex fed along the way, so a definition knows the classes around it. Instance,
+// class and global variables are recorded at their first assignment in each scope of a
+// file. Indexes built for different files on different threads merge() into one; adding
+// or merging a file that is already present replaces its definitions.
+class DefinitionIndex {
+public:
+    // Replaces what the index holds for `path` with the definitions in `tokens`, which were
+    // lexed from `source`.
+    template <typename Tokens>
+    void addFile(std::string_view path, std::string_view source, const Tokens& tokens) {
+        FileScan scan(*this, fileId(path));
+        scan.blocks.reset(source);
+        uint32_t index = 0;
+        for (const TokenView& token : tokens) {
+            scan.blocks.add(token);
+            scan.take(token, index++);
+        }
+    }
+
+    // Takes in every file of `other`, replacing the ones already here.
+    void merge(const DefinitionIndex& other) {
+        std::vector<uint32_t> files(other.paths.size());
+        for (size_t f = 0; f < other.paths.size(); f++) files[f] = fileId(other.paths[f]);
+        const uint32_t shift = static_cast<uint32_t>(strings.size());
+        strings += other.strings;
+        for (DefinitionRecord record : other.records) {
+            record.name += shift;
+            record.scope += shift;
+            record.file = files[record.file];
+            records.push_back(record);
+        }
+    }
+
+    // Replaces the contents with those of an index file.
+    void load(const DefinitionFile& file);
+
+    size_t size() const { return records.size(); }
+    size_t fileCount() const { return paths.size(); }
+
+    Definition operator[](size_t i) const {
+        const DefinitionRecord& record = records[i];
+        return {std::string_view(strings).substr(record.name, record.nameLength),
+                std::string_view(strings).substr(record.scope, record.scopeLength),
+                paths[record.file], record.line, static_cast<DefinitionKind>(record.kind)};
+    }
+
+    // The index file image: records sorted by name, kind, path and line, each distinct
+    // string stored once.
+    std::string encode() const {
+        std::vector<uint32_t> order(records.size());
+        std::iota(order.begin(), order.end(), 0);
+        auto key = [this](uint32_t i) {
+            Definition d = (*this)[i];
+            return std::make_tuple(d.name, d.kind, d.path, d.line);
+        };
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return key(a) < key(b); });
+
+        std::string table;
+        std::unordered_map<std::string_view, uint32_t> interned;
+        auto intern = [&](std::string_view text) {
+            auto [it, added] = interned.try_emplace(text, static_cast<uint32_t>(table.size()));
+            if (added) table.append(text);
+            return it->second;
+        };
+
+        DefinitionIndexHeader header{};
+        memcpy(header.magic, DEFINITION_INDEX_MAGIC, sizeof(header.magic));
+        header.formatVersion = DEFINITION_INDEX_FORMAT;
+        header.lexerVersion = LEXER_VERSION;
+        header.definitionCount = records.size();
+        header.fileCount = paths.size();
+
+        std::string body;
+        body.reserve(records.size() * sizeof(DefinitionRecord) + paths.size() * 2 * sizeof(uint32_t));
+        for (uint32_t i : order) {
+            DefinitionRecord record = records[i];
+            Definition d = (*this)[i];
+            record.name = intern(d.name);
+            record.scope = intern(d.scope);
+            body.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        }
+        for (const std::string& path : paths) {
+            uint32_t span[2] = {intern(path), static_cast<uint32_t>(path.size())};
+            body.append(reinterpret_cast<const char*>(span), sizeof(span));
+        }
+        header.stringBytes = table.size();
+
+        std::string out(reinterpret_cast<const char*>(&header), sizeof(header));
+        out += body;
+        out += table;
+        return out;
+    }
+
+private:
+    std::string strings;
+    std::vector<DefinitionRecord> records;
+    std::vector<std::string> paths;
+    std::unordered_map<std::string, uint32_t> fileIds;
+
+    // Index of `path` in the file table, with any definitions it had dropped.
+    uint32_t fileId(std::string_view path) {
+        auto [it, added] = fileIds.try_emplace(std::string(path), static_cast<uint32_t>(paths.size()));
+        if (added) {
+            paths.emplace_back(path);
+        } else {
+            uint32_t file = it->second;
+            records.erase(std::remove_if(records.begin(), records.end(), [file](const DefinitionRecord& r) { return r.file == file; }),
+                          records.end());
+        }
+        return it->second;
+    }
+
+    uint32_t addString(std::string_view text) {
+        uint32_t offset = static_cast<uint32_t>(strings.size());
+        strings.append(text);
+        return offset;
+    }
+
+    // The walk over one file's tokens: a definition keyword or a variable arms `expect`, and
+    // the tokens after it complete the name or call it off.
+    struct FileScan {
+        enum class Expect : uint8_t { NOTHING, CLASS_NAME, METHOD_NAME, METHOD_SUFFIX, ASSIGNMENT };
+
+        struct Scope {
+            uint32_t offset;          // of the qualified name in `strings`
+            uint16_t length;
+            bool singleton;           // class << self: its methods belong to the class
+            size_t depth;             // BlockIndex::openCount() while the body is open
+        };
+
+        FileScan(DefinitionIndex& index, uint32_t file) : index(index), file(file) {}
+
+        DefinitionIndex& index;
+        uint32_t file;
+        BlockIndex blocks;
+        std::vector<Scope> scopes;
+        std::unordered_set<std::string> assigned;   // variables already recorded, keyed by name and scope
+
+        Expect expect = Expect::NOTHING;
+        DefinitionKind kind = DefinitionKind::CLASS;
+        std::string name;
+        uint32_t line = 0;
+        const char* nameEnd = nullptr;   // a method name continues with bytes glued to it
+        size_t depth = 0;
+        bool receiver = false;
+        bool afterDot = false;
+
+        void take(const TokenView& token, uint32_t i) {
+            if (expect != Expect::NOTHING && continueName(token)) {
+                afterDot = false;
+                return;
+            }
+            switch (token.type) {
+                case TokenType::KEYWORD:
+                    if ((token.keyword == Keyword::KEYWORD_CLASS || token.keyword == Keyword::KEYWORD_MODULE) && blocks.innermost() == i) {
+                        arm(Expect::CLASS_NAME, token.keyword == Keyword::KEYWORD_CLASS ? DefinitionKind::CLASS : DefinitionKind::MODULE, token);
+                        depth = blocks.openCount();
+                    } else if (token.keyword == Keyword::KEYWORD_DEF && !afterDot) {
+                        // An endless def opens no block, so `def` counts unless it is called as a method.
+                        arm(Expect::METHOD_NAME, DefinitionKind::METHOD, token);
+                        receiver = false;
+                    }
+                    break;
+                case TokenType::IDENTIFIER_INSTANCE: armVariable(DefinitionKind::INSTANCE_VARIABLE, token); break;
+                case TokenType::IDENTIFIER_CLASS: armVariable(DefinitionKind::CLASS_VARIABLE, token); break;
+                case TokenType::IDENTIFIER_GLOBAL: armVariable(DefinitionKind::GLOBAL_VARIABLE, token); break;
+                case TokenType::CONSTANT: armVariable(DefinitionKind::CONSTANT, token); break;
+                default: break;
+            }
+            while (!scopes.empty() && blocks.openCount() < scopes.back().depth) scopes.pop_back();
+            afterDot = token.op == Operator::OPERATOR_DOT || token.op == Operator::OPERATOR_SAFE_NAVIGATION;
+        }
+
+        void arm(Expect next, DefinitionKind armedKind, const TokenView& token) {
+            expect = next;
+            kind = armedKind;
+            name.clear();
+            line = token.line;
+        }
+
+        void armVariable(DefinitionKind variableKind, const TokenView& token) {
+            arm(Expect::ASSIGNMENT, variableKind, token);
+            name.assign(token.lexeme);
+        }
+
+        // Feeds `token` to the definition being read. True when the token was part of it.
+        bool continueName(const TokenView& token) {
+            const bool glued = token.lexeme.data() == nameEnd;
+            switch (expect) {
+                case Expect::CLASS_NAME:
+                    if (name.empty() && kind == DefinitionKind::CLASS && token.op == Operator::OPERATOR_SHIFT_LEFT) {
+                        Scope outer = currentScope();
+                        scopes.push_back({outer.offset, outer.length, true, depth});
+                        expect = Expect::NOTHING;
+                        return true;
+                    }
+                    if (token.type == TokenType::CONSTANT && (name.empty() || name.back() == ':')) {
+                        name.append(token.lexeme);
+                        return true;
+                    }
+                    if (token.op == Operator::OPERATOR_SCOPE && !name.empty() && name.back() != ':') {
+                        name += "::";
+                        return true;
+                    }
+                    if (!name.empty() && name.back() != ':') {
+                        Scope outer = currentScope();
+                        std::string qualified(std::string_view(index.strings).substr(outer.offset, outer.length));
+                        if (!qualified.empty()) qualified += "::";
+                        qualified += name;
+                        if (qualified.size() > UINT16_MAX) {
+                            record(outer);
+                            break;
+                        }
+                        Scope inner{index.addString(qualified), static_cast<uint16_t>(qualified.size()), false, depth};
+                        // `class A::B` defines B inside A: the last segment is the name and the
+                        // rest extends the scope, a prefix of the qualified name just stored.
+                        size_t split = name.rfind("::");
+                        if (split == std::string::npos) {
+                            record(outer);
+                        } else {
+                            name.erase(0, split + 2);
+                            record({inner.offset, static_cast<uint16_t>(inner.length - name.size() - 2), false, depth});
+                        }
+                        scopes.push_back(inner);
+                    }
+                    break;
+
+                case Expect::METHOD_NAME:
+                    if (token.type == TokenType::IDENTIFIER_LOCAL || token.type == TokenType::CONSTANT || token.type == TokenType::KEYWORD ||
+                        token.type == TokenType::OPERATOR || token.lexeme == "[") {
+                        name.append(token.lexeme);
+                        line = token.line;
+                        nameEnd = token.lexeme.data() + token.lexeme.size();
+                        expect = Expect::METHOD_SUFFIX;
+                        return true;
+                    }
+                    break;
+
+                case Expect::METHOD_SUFFIX:
+                    // `valid?`, `save!`, `name=`, `[]=` and `-@` arrive in pieces.
+                    if (glued && (token.lexeme == "]" || token.lexeme == "@" || token.op == Operator::OPERATOR_ASSIGN ||
+                                  token.op == Operator::OPERATOR_QUESTION || token.op == Operator::OPERATOR_NOT)) {
+                        name.append(token.lexeme);
+                        nameEnd = token.lexeme.data() + token.lexeme.size();
+                        return true;
+                    }
+                    // `def self.name` and `def Class.name`: what came first was the receiver.
+                    if (!receiver && token.op == Operator::OPERATOR_DOT) {
+                        receiver = true;
+                        name.clear();
+                        expect = Expect::METHOD_NAME;
+                        return true;
+                    }
+                    if (receiver || currentScope().singleton) kind = DefinitionKind::SINGLETON_METHOD;
+                    record(currentScope());
+                    break;
+
+                case Expect::ASSIGNMENT:
+                    if (isAssignment(token.op)) {
+                        Scope scope = kind == DefinitionKind::GLOBAL_VARIABLE ? Scope{0, 0, false, 0} : currentScope();
+                        std::string key = name;
+                        key += '\0';
+                        key += std::string_view(index.strings).substr(scope.offset, scope.length);
+                        if (kind == DefinitionKind::CONSTANT || assigned.insert(std::move(key)).second) record(scope);
+                    }
+                    break;
+
+                case Expect::NOTHING:
+                    break;
+            }
+            expect = Expect::NOTHING;
+            return false;
+        }
+
+        Scope currentScope() const { return scopes.empty() ? Scope{0, 0, false, 0} : scopes.back(); }
+
+        void record(const Scope& scope) {
+            if (name.size() > UINT16_MAX) return;
+            DefinitionRecord entry{};
+            entry.name = index.addString(name);
+            entry.nameLength = static_cast<uint16_t>(name.size());
+            entry.scope = scope.offset;
+            entry.scopeLength = scope.length;
+            entry.file = file;
+            entry.line = line;
+            entry.kind = static_cast<uint8_t>(kind);
+            index.records.push_back(entry);
+        }
+
+        static bool isAssignment(Operator op) {
+            switch (op) {
+                case Operator::OPERATOR_ASSIGN: case Operator::OPERATOR_PLUS_ASSIGN: case Operator::OPERATOR_MINUS_ASSIGN:
+                case Operator::OPERATOR_STAR_ASSIGN: case Operator::OPERATOR_POWER_ASSIGN: case Operator::OPERATOR_SLASH_ASSIGN:
+                case Operator::OPERATOR_PERCENT_ASSIGN: case Operator::OPERATOR_AND_ASSIGN: case Operator::OPERATOR_OR_ASSIGN:
+                case Operator::OPERATOR_BIT_AND_ASSIGN: case Operator::OPERATOR_BIT_OR_ASSIGN: case Operator::OPERATOR_BIT_XOR_ASSIGN:
+                case Operator::OPERATOR_SHIFT_LEFT_ASSIGN: case Operator::OPERATOR_SHIFT_RIGHT_ASSIGN:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+    };
+};
+
+// Memory-mapped definition index. Lookups binary-search the sorted records in place; a
+// record is only copied out when it is read.
+class DefinitionFile {
+public:
+    bool open(const std::string& path) {
+        return file.open(path) && load(file.view());
+    }
+
+    // Uses an already encoded index in memory, which must outlive this object. Every record
+    // and file entry is checked against the string table here, so reads need no checks.
+    bool load(std::string_view data) {
+        records = nullptr;
+        if (data.size() < sizeof(header)) return false;
+        memcpy(&header, data.data(), sizeof(header));
+        if (memcmp(header.magic, DEFINITION_INDEX_MAGIC, sizeof(header.magic)) != 0 || header.formatVersion != DEFINITION_INDEX_FORMAT) return false;
+        uint64_t expected = sizeof(header) + uint64_t(header.definitionCount) * sizeof(DefinitionRecord) +
+                            uint64_t(header.fileCount) * 2 * sizeof(uint32_t) + header.stringBytes;
+        if (expected != data.size()) return false;
+        const char* base = data.data() + sizeof(header);
+        const char* fileTable = base + size_t(header.definitionCount) * sizeof(DefinitionRecord);
+        strings = std::string_view(fileTable + size_t(header.fileCount) * 2 * sizeof(uint32_t), header.stringBytes);
+        files = fileTable;
+        for (uint32_t f = 0; f < header.fileCount; f++) {
+            uint32_t span[2];
+            memcpy(span, files + f * sizeof(span), sizeof(span));
+            if (span[0] > strings.size() || span[1] > strings.size() - span[0]) return false;
+        }
+        for (uint32_t i = 0; i < header.definitionCount; i++) {
+            DefinitionRecord record;
+            memcpy(&record, base + size_t(i) * sizeof(record), sizeof(record));
+            if (record.file >= header.fileCount || record.kind >= DEFINITION_KIND_COUNT ||
+                record.name > strings.size() || record.nameLength > strings.size() - record.name ||
+                record.scope > strings.size() || record.scopeLength > strings.size() - record.scope) return false;
+        }
+        records = base;
+        return true;
+    }
+
+    // Whether this lexer wrote it; an index from another one may miss or misplace names.
+    bool current() const { return records && header.lexerVersion == LEXER_VERSION; }
+
+    size_t size() const { return records ? header.definitionCount : 0; }
+    size_t fileCount() const { return records ? header.fileCount : 0; }
+
+    std::string_view path(size_t f) const {
+        uint32_t span[2];
+        memcpy(span, files + f * sizeof(span), sizeof(span));
+        return strings.substr(span[0], span[1]);
+    }
+
+    Definition operator[](size_t i) const {
+        DefinitionRecord r = record(i);
+        return {strings.substr(r.name, r.nameLength), strings.substr(r.scope, r.scopeLength), path(r.file), r.line,
+                static_cast<DefinitionKind>(r.kind)};
+    }
+
+    // The definitions whose name starts with `prefix`, as the index range [first, last).
+    std::pair<size_t, size_t> findPrefix(std::string_view prefix) const {
+        auto nameAt = [this](size_t i) {
+            DefinitionRecord r = record(i);
+            return strings.substr(r.name, r.nameLength);
+        };
+        size_t first = partitionPoint(0, size(), [&](size_t i) { return nameAt(i) < prefix; });
+        size_t last = partitionPoint(first, size(), [&](size_t i) { return nameAt(i).substr(0, prefix.size()) <= prefix; });
+        return {first, last};
+    }
+
+private:
+    friend class DefinitionIndex;
+
+    SourceFile file;
+    DefinitionIndexHeader header{};
+    const char* records = nullptr;
+    const char* files = nullptr;
+    std::string_view strings;
+
+    DefinitionRecord record(size_t i) const {
+        DefinitionRecord r;
+        memcpy(&r, records + i * sizeof(r), sizeof(r));
+        return r;
+    }
+
+    template <typename Predicate>
+    static size_t partitionPoint(size_t first, size_t last, Predicate below) {
+        while (first < last) {
+            size_t middle = first + (last - first) / 2;
+            if (below(middle)) first = middle + 1;
+            else last = middle;
+        }
+        return first;
+    }
+};
+
+inline void DefinitionIndex::load(const DefinitionFile& file) {
+    strings.assign(file.strings);
+    records.resize(file.size());
+    for (size_t i = 0; i < records.size(); i++) records[i] = file.record(i);
+    paths.clear();
+    fileIds.clear();
+    for (size_t f = 0; f < file.fileCount(); f++) {
+        paths.emplace_back(file.path(f));
+        fileIds.emplace(paths.back(), static_cast<uint32_t>(f));
+    }
+}
+
+// How a TokenStream drives the lexer: one scanStep() at a time over the stream's buffer.
+class StreamScanner {
+public:
+    LexModes& modes() { return lexer.modes; }
+
+    bool scan(std::string_view buffer, size_t pos, size_t& end, TokenView& token) {
+        lexer.source = buffer;
+        lexer.current = pos;
+        scratch.clear();
+        lexer.scanStep(scratch);
+        end = lexer.current;
+        if (scratch.empty()) return false;
+        token = scratch.back();
+        return true;
+    }
+
+private:
+    Lexer lexer{std::string_view()};
+    std::vector<TokenView> scratch;
+};
+
+using TokenStream = BasicTokenStream<StreamScanner>;
+
+// Owns a source buffer and its tokens and keeps them in step under edits, re-lexing only
+// the stretch an edit can change. Lexemes point into text() and stay valid until the next
+// edit.
+class IncrementalLexer {
+public:
+    // Which tokens the last edit replaced: [first, first + removed) of the old vector became
+    // [first, first + inserted) of the new one. Tokens after that are the old ones, moved.
+    struct Change {
+        size_t first = 0;
+        size_t removed = 0;
+        size_t inserted = 0;
+    };
+
+    explicit IncrementalLexer(std::string text) : buffer(std::move(text)) {
+        tokenList = Lexer(buffer).analyzeRecorded(unsettled);
+    }
+
+    const std::string& text() const { return buffer; }
+    const std::vector<TokenView>& tokens() const { return tokenList; }
+
+    // Replaces `removed` bytes at `offset` with `inserted`. The result is always what
+    // analyze() would return for the new text.
+    Change edit(size_t offset, size_t removed, std::string_view inserted) {
+        offset = std::min(offset, buffer.size());
+        removed = std::min(removed, buffer.size() - offset);
+        const uintptr_t oldBase = reinterpret_cast<uintptr_t>(buffer.data());
+        const size_t oldSize = buffer.size();
+        auto oldStart = [&](size_t i) -> size_t {
+            if (tokenList[i].type == TokenType::END_OF_FILE) return oldSize;
+            return reinterpret_cast<uintptr_t>(tokenList[i].lexeme.data()) - oldBase;
+        };
+        const size_t eof = tokenList.size() - 1;
+
+        // A token's scan reads at most one byte past its end (see TokenStream::next), and
+        // between tokens in plain code the lexer carries nothing but the line number, which
+        // is 1 plus the newlines before the position. So lexing can resume right after the
+        // last token whose scan ended more than a byte before the edit and that left the
+        // lexer settled in plain code. Inside strings and heredocs it backs up to where they
+        // opened.
+        size_t first = std::partition_point(tokenList.begin(), tokenList.begin() + eof, [&](const TokenView& token) {
+            size_t start = reinterpret_cast<uintptr_t>(token.lexeme.data()) - oldBase;
+            return start + token.lexeme.size() + 1 < offset;
+        }) - tokenList.begin();
+        while (first > 0 && unsettled[first]) first--;
+        size_t restart = first > 0 ? oldStart(first - 1) + tokenList[first - 1].lexeme.size() : 0;
+        int restartLine = 1;
+        if (first > 0) {
+            std::string_view last = tokenList[first - 1].lexeme;
+            restartLine = tokenList[first - 1].line + static_cast<int>(std::count(last.begin(), last.end(), '\n'));
+        }
+
+        // Old tokens that start past the removed bytes can be reused once the new scan reaches
+        // the same position; their offsets and lines move by a fixed amount.
+        const size_t editEnd = offset + removed;
+        size_t reuse = first;
+        while (reuse < eof && oldStart(reuse) < editEnd) reuse++;
+        const ptrdiff_t shift = static_cast<ptrdiff_t>(inserted.size()) - static_cast<ptrdiff_t>(removed);
+        const int lineShift = static_cast<int>(std::count(inserted.begin(), inserted.end(), '\n')) -
+                              static_cast<int>(std::count(buffer.begin() + offset, buffer.begin() + editEnd, '\n'));
+
+        // Stored lexemes keep their old addresses until rebased below; oldStart() only uses
+        // them as numbers, so it still works after the buffer moves.
+        buffer.replace(offset, removed, inserted);
+
+        Lexer lexer(buffer);
+        lexer.current = restart;
+        lexer.line = restartLine;
+        std::vector<TokenView> fresh;
+        std::vector<uint8_t> freshUnsettled;
+        size_t tail = reuse;
+        bool synced = false;
+        while (!lexer.isAtEnd()) {
+            // Strictly past the inserted text: a heredoc opener looks at the byte before it.
+            if (lexer.current > static_cast<int>(offset + inserted.size()) && lexer.modes.settledAt(lexer.current)) {
+                size_t old = lexer.current - shift;
+                while (tail < eof && oldStart(tail) < old) tail++;
+                if (tail < eof && oldStart(tail) == old && !unsettled[tail]) {
+                    synced = true;
+                    break;
+                }
+            }
+            lexer.scanStepRecorded(fresh, freshUnsettled);
+        }
+
+        const uintptr_t newBase = reinterpret_cast<uintptr_t>(buffer.data());
+        if (newBase != oldBase) {
+            for (size_t i = 0; i < first; i++) {
+                tokenList[i].lexeme = std::string_view(buffer.data() + oldStart(i), tokenList[i].lexeme.size());
+            }
+        }
+        if (synced) {
+            for (size_t i = tail; i < eof; i++) {
+                tokenList[i].lexeme = std::string_view(buffer.data() + oldStart(i) + shift, tokenList[i].lexeme.size());
+                tokenList[i].line += lineShift;
+            }
+            tokenList[eof].line += lineShift;
+        } else {
+            tail = tokenList.size();
+            fresh.push_back({TokenType::END_OF_FILE, "", lexer.line});
+            freshUnsettled.push_back(!lexer.modes.settledAt(lexer.current));
+        }
+
+        // Splice with a single move of the reused tail.
+        Change change{first, tail - first, fresh.size()};
+        if (change.inserted > change.removed) {
+            tokenList.insert(tokenList.begin() + tail, change.inserted - change.removed, TokenView{TokenType::END_OF_FILE, "", 0});
+            unsettled.insert(unsettled.begin() + tail, change.inserted - change.removed, 0);
+        } else {
+            tokenList.erase(tokenList.begin() + first + change.inserted, tokenList.begin() + tail);
+            unsettled.erase(unsettled.begin() + first + change.inserted, unsettled.begin() + tail);
+        }
+        std::copy(fresh.begin(), fresh.end(), tokenList.begin() + first);
+        std::copy(freshUnsettled.begin(), freshUnsettled.end(), unsettled.begin() + first);
+        return change;
+    }
+
+private:
+    std::string buffer;
+    std::vector<TokenView> tokenList;
+    std::vector<uint8_t> unsettled;   // per token, see Lexer::scanStepRecorded()
+};
+
+using LexerSession = BasicLexerSession<Lexer>;
+
+inline void printTokens(const std::vector<TokenView>& tokens, TokenWriter& writer) {
+    for (const auto& token : tokens) {
+        writer.write(token);
+    }
+}
+
+// Bounded lock-free queue from one producer thread to one consumer thread. The slots are
+// allocated once and filled in place. The producer publishes them a batch at a time with one
+// release store, and the consumer takes everything published up to the wrap point in one
+// go. Each side keeps its last look at the other's counter and reloads it only when that
+// says the ring is full or empty, so the shared counters are touched once per batch rather
+// than once per item. A full ring makes the producer wait for the consumer, and close()
+// marks the end of the stream once the consumer has read what was pushed before it.
+template <typename T>
+class SpscRing {
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 1 << 14;
+    static constexpr size_t DEFAULT_BATCH = 512;
+
+    // `capacity` is rounded up to a power of two; `batch` is capped at half of it so the
+    // consumer can work on one half while the producer fills the other.
+    explicit SpscRing(size_t capacity = DEFAULT_CAPACITY, size_t batch = DEFAULT_BATCH)
+        : slots(roundUpToPowerOfTwo(std::max<size_t>(capacity, 2))),
+          mask(slots.size() - 1),
+          batch(std::clamp<size_t>(batch, 1, slots.size() / 2)) {}
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Producer: stores `item`, publishing the batch once it is full. Waits while the ring is.
+    void push_back(const T& item) {
+        if (written - headSeen == slots.size()) waitForSpace();
+        slots[written & mask] = item;
+        written++;
+        if (written - published >= batch) publish();
+    }
+
+    // Producer: publishes what is left and ends the stream. Nothing may be pushed after it.
+    void close() {
+        publish();
+        closed.store(true, std::memory_order_release);
+    }
+
+    // Consumer: waits for published items and returns how many can be read from front()
+    // without wrapping, or 0 once the ring is closed and drained.
+    size_t wait() {
+        for (unsigned spins = 0;; spins++) {
+            if (read == tailSeen) tailSeen = tail.load(std::memory_order_acquire);
+            if (read != tailSeen) return std::min(tailSeen - read, slots.size() - (read & mask));
+            // Checked after the tail: close() stores the final tail before the flag.
+            if (closed.load(std::memory_order_acquire)) {
+                tailSeen = tail.load(std::memory_order_acquire);
+                if (read == tailSeen) return 0;
+                continue;
+            }
+            backOff(spins);
+        }
+    }
+
+    // Consumer: the first of the items wait() reported.
+    const T* front() const { return &slots[read & mask]; }
+
+    // Consumer: hands the first `count` items back to the producer.
+    void pop(size_t count) {
+        read += count;
+        head.store(read, std::memory_order_release);
+    }
+
+    size_t capacity() const { return slots.size(); }
+
+private:
+    static constexpr size_t CACHE_LINE = 64;
+    static constexpr unsigned SPIN_LIMIT = 64;
+
+    std::vector<T> slots;
+    const size_t mask;
+    const size_t batch;
+
+    // Counters run freely and are masked on use, so a full ring and an empty one differ.
+    alignas(CACHE_LINE) std::atomic<size_t> tail{0};   // items published
+    std::atomic<bool> closed{false};
+    alignas(CACHE_LINE) std::atomic<size_t> head{0};   // items the consumer is done with
+
+    // Producer only.
+    alignas(CACHE_LINE) size_t written = 0;
+    size_t published = 0;
+    size_t headSeen = 0;
+
+    // Consumer only.
+    alignas(CACHE_LINE) size_t read = 0;
+    size_t tailSeen = 0;
+
+    static size_t roundUpToPowerOfTwo(size_t n) {
+        size_t size = 1;
+        while (size < n) size <<= 1;
+        return size;
+    }
+
+    void publish() {
+        if (published == written) return;
+        published = written;
+        tail.store(written, std::memory_order_release);
+    }
+
+    // The consumer may be waiting on the unpublished part of this batch, so that goes first.
+    void waitForSpace() {
+        publish();
+        for (unsigned spins = 0; written - (headSeen = head.load(std::memory_order_acquire)) == slots.size(); spins++) {
+            backOff(spins);
+        }
+    }
+
+    static void backOff(unsigned spins) {
+        if (spins >= SPIN_LIMIT) std::this_thread::yield();
+    }
+};
+
+using TokenRing = SpscRing<TokenView>;
+
+// Lexes `source` on a thread of its own while the calling thread passes each token, in
+// order, to `consume`, so lexing overlaps with whatever the consumer does with the tokens.
+// Tokens travel through a TokenRing of `capacity` slots; lexemes point into `source`.
+template <typename Consume>
+void lexPipelined(std::string_view source, Consume&& consume, size_t capacity = TokenRing::DEFAULT_CAPACITY,
+                  size_t batch = TokenRing::DEFAULT_BATCH) {
+    TokenRing ring(capacity, batch);
+    std::thread producer([&ring, source] {
+        Lexer(source).analyzeTo(ring);
+        ring.close();
+    });
+    for (size_t count; (count = ring.wait()) > 0; ring.pop(count)) {
+        const TokenView* tokens = ring.front();
+        for (size_t i = 0; i < count; i++) consume(tokens[i]);
+    }
+    producer.join();
+}
+
+static_assert(TOKEN_TYPE_COUNT <= 32, "token types must fit a 32-bit mask");
+constexpr uint32_t typeBit(TokenType type) { return 1u << static_cast<uint32_t>(type); }
+
+// Names to find among tokens. A pattern is NAME, or NAME* for every name starting with
+// NAME, optionally preceded by a token type as TYPE:NAME to match only tokens of that type;
+// TYPE:* matches every token of the type.
+// Without a type a pattern matches any token but comments, strings and heredoc bodies, so
+// `@name` inside a comment or a plain string is no hit while one in an interpolation is.
+// Exact names are one hash lookup per token; prefixes are one lookup per distinct prefix
+// length. Each name maps to the set of types it is wanted in.
+class TokenSearch {
+public:
+    // Returns false for a pattern with neither a name nor a type, or with an unknown type.
+    bool add(std::string_view pattern) {
+        uint32_t types = DEFAULT_TYPES;
+        bool typed = false;
+        size_t colon = pattern.find(':');
+        if (colon != std::string_view::npos) {
+            auto named = std::find(std::begin(tokenTypeNames), std::end(tokenTypeNames), pattern.substr(0, colon));
+            if (named != std::end(tokenTypeNames)) {
+                types = typeBit(static_cast<TokenType>(named - std::begin(tokenTypeNames)));
+                typed = true;
+                pattern.remove_prefix(colon + 1);
+            } else if (colon > 0 && pattern.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZ_") == colon) {
+                return false;
+            }
+        }
+        bool prefix = !pattern.empty() && pattern.back() == '*';
+        if (prefix) pattern.remove_suffix(1);
+        if (pattern.empty() && !(typed && prefix)) return false;
+
+        std::string_view name = names.emplace_back(pattern);
+        (prefix ? prefixes : exact)[name] |= types;
+        if (name.empty()) everyFile = true;
+        else needles.add(name);
+        if (prefix && std::find(prefixLengths.begin(), prefixLengths.end(), name.size()) == prefixLengths.end()) {
+            prefixLengths.push_back(name.size());
+        }
+        wantedTypes |= types;
+        return true;
+    }
+
+    bool empty() const { return names.empty(); }
+
+    // Whether some pattern's name occurs anywhere in `source`, in code or not, found for all
+    // the names in one pass. A file without one cannot have a hit and need not be lexed. A
+    // TYPE:* pattern has no name to look for, so with one every file is lexed.
+    bool mayMatch(std::string_view source) const {
+        return everyFile || kernels.containsAny(source.data(), source.data() + source.size(), needles);
+    }
+
+    bool matches(TokenType type, std::string_view lexeme) const {
+        uint32_t bit = typeBit(type);
+        if (!(wantedTypes & bit)) return false;
+        auto found = exact.find(lexeme);
+        if (found != exact.end() && (found->second & bit)) return true;
+        for (size_t length : prefixLengths) {
+            if (length > lexeme.size()) continue;
+            found = prefixes.find(lexeme.substr(0, length));
+            if (found != prefixes.end() && (found->second & bit)) return true;
+        }
+        return false;
+    }
+
+private:
+    static constexpr uint32_t DEFAULT_TYPES =
+        ~(typeBit(TokenType::COMMENT) | typeBit(TokenType::STRING_LITERAL) | typeBit(TokenType::STRING_FRAGMENT) |
+          typeBit(TokenType::HEREDOC_BEGIN) | typeBit(TokenType::HEREDOC_END) | typeBit(TokenType::END_OF_FILE));
+
+    std::deque<std::string> names;   // a deque, so the views into it stay put
+    std::unordered_map<std::string_view, uint32_t> exact;
+    std::unordered_map<std::string_view, uint32_t> prefixes;
+    std::vector<size_t> prefixLengths;
+    SubstringSet needles;
+    bool everyFile = false;
+    uint32_t wantedTypes = 0;
+    const ScanKernels& kernels = ScanKernels::best();
+};
+
+}  // namespace handwritten
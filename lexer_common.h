@@ -0,0 +1,2701 @@
+// Declarations shared by the hand-written lexer (lexer.h) and the finite automaton
+// (state/automaton.h): token types, keyword and operator tables, number decoding, the scan
+// kernels and line index, string and heredoc modes, token storage, block matching, and the
+// file, output and batch plumbing both programs use.
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cctype>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <charconv>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <system_error>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_set>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <string_view>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
+
+enum class TokenType {
+    NUMBER_INT,
+    NUMBER_FLOAT,
+    NUMBER_HEX,
+
+    STRING_LITERAL,
+    STRING_FRAGMENT,      // part of a string cut by interpolation, or of a heredoc body
+    INTERPOLATION_BEGIN,
+    INTERPOLATION_END,
+    HEREDOC_BEGIN,
+    HEREDOC_END,
+
+    IDENTIFIER_LOCAL,    
+    IDENTIFIER_INSTANCE, 
+    IDENTIFIER_CLASS,    
+    IDENTIFIER_GLOBAL,   
+    CONSTANT,            
+
+    SYMBOL,              
+    KEYWORD,
+    OPERATOR,
+    SEPARATOR,           
+    COMMENT,
+    
+    RANGE_INCLUSIVE,     
+    RANGE_EXCLUSIVE,     
+
+    UNKNOWN,             
+    END_OF_FILE          
+};
+
+enum class Keyword : uint8_t {
+    NOT_KEYWORD,
+    KEYWORD_ALIAS, KEYWORD_AND, KEYWORD_BEGIN, KEYWORD_BREAK, KEYWORD_CASE, KEYWORD_CLASS,
+    KEYWORD_DEF, KEYWORD_DEFINED, KEYWORD_DO, KEYWORD_ELSE, KEYWORD_ELSIF, KEYWORD_END,
+    KEYWORD_ENSURE, KEYWORD_FALSE, KEYWORD_FOR, KEYWORD_IF, KEYWORD_IN, KEYWORD_MODULE,
+    KEYWORD_NEXT, KEYWORD_NIL, KEYWORD_NOT, KEYWORD_OR, KEYWORD_REDO, KEYWORD_RESCUE,
+    KEYWORD_RETRY, KEYWORD_RETURN, KEYWORD_SELF, KEYWORD_SUPER, KEYWORD_THEN, KEYWORD_TRUE,
+    KEYWORD_UNDEF, KEYWORD_UNLESS, KEYWORD_UNTIL, KEYWORD_WHEN, KEYWORD_WHILE, KEYWORD_YIELD
+};
+
+constexpr int KEYWORD_COUNT = static_cast<int>(Keyword::KEYWORD_YIELD) + 1;
+
+// Indexed by Keyword.
+constexpr std::string_view keywordSpellings[KEYWORD_COUNT] = {
+    "",
+    "alias", "and", "begin", "break", "case", "class", "def", "defined?", 
+    "do", "else", "elsif", "end", "ensure", "false", "for", "if", "in", 
+    "module", "next", "nil", "not", "or", "redo", "rescue", "retry", 
+    "return", "self", "super", "then", "true", "undef", "unless", 
+    "until", "when", "while", "yield"
+};
+
+// Keywords are told apart by first byte, last byte and length alone; a multiplicative hash
+// of those folds them into a 128-slot table. The multiplier is searched for at compile time.
+constexpr int KEYWORD_HASH_BITS = 7;
+constexpr size_t KEYWORD_MIN_LENGTH = 2;
+constexpr size_t KEYWORD_MAX_LENGTH = 8;
+
+constexpr uint32_t keywordSlot(std::string_view word, uint32_t multiplier) {
+    uint32_t key = uint32_t(static_cast<unsigned char>(word.front())) << 16
+                 | uint32_t(static_cast<unsigned char>(word.back())) << 8
+                 | uint32_t(word.size() & 0xff);
+    return (key * multiplier) >> (32 - KEYWORD_HASH_BITS);
+}
+
+constexpr uint32_t findKeywordMultiplier() {
+    for (uint32_t k = 1;; k++) {
+        uint32_t multiplier = (k * 0x9E3779B1u) | 1;
+        bool used[1 << KEYWORD_HASH_BITS] = {};
+        bool perfect = true;
+        for (int i = 1; i < KEYWORD_COUNT && perfect; i++) {
+            uint32_t slot = keywordSlot(keywordSpellings[i], multiplier);
+            perfect = !used[slot];
+            used[slot] = true;
+        }
+        if (perfect) return multiplier;
+    }
+}
+
+constexpr uint32_t KEYWORD_MULTIPLIER = findKeywordMultiplier();
+
+constexpr std::array<Keyword, 1 << KEYWORD_HASH_BITS> buildKeywordTable() {
+    std::array<Keyword, 1 << KEYWORD_HASH_BITS> table{};
+    for (int i = 1; i < KEYWORD_COUNT; i++) {
+        table[keywordSlot(keywordSpellings[i], KEYWORD_MULTIPLIER)] = static_cast<Keyword>(i);
+    }
+    return table;
+}
+
+constexpr std::array<Keyword, 1 << KEYWORD_HASH_BITS> keywordTable = buildKeywordTable();
+
+// One hash and at most one comparison; never allocates.
+constexpr Keyword classifyKeyword(std::string_view word) {
+    if (word.size() < KEYWORD_MIN_LENGTH || word.size() > KEYWORD_MAX_LENGTH) return Keyword::NOT_KEYWORD;
+    Keyword candidate = keywordTable[keywordSlot(word, KEYWORD_MULTIPLIER)];
+    return keywordSpellings[static_cast<int>(candidate)] == word ? candidate : Keyword::NOT_KEYWORD;
+}
+
+static_assert(classifyKeyword("defined?") == Keyword::KEYWORD_DEFINED, "keyword table is broken");
+static_assert(classifyKeyword("end") == Keyword::KEYWORD_END, "keyword table is broken");
+static_assert(classifyKeyword("ends") == Keyword::NOT_KEYWORD, "keyword table is broken");
+
+enum class Operator : uint8_t {
+    NOT_OPERATOR,
+    OPERATOR_PLUS, OPERATOR_MINUS, OPERATOR_STAR, OPERATOR_POWER, OPERATOR_SLASH, OPERATOR_PERCENT,
+    OPERATOR_PLUS_ASSIGN, OPERATOR_MINUS_ASSIGN, OPERATOR_STAR_ASSIGN, OPERATOR_POWER_ASSIGN,
+    OPERATOR_SLASH_ASSIGN, OPERATOR_PERCENT_ASSIGN,
+    OPERATOR_ASSIGN, OPERATOR_EQUAL, OPERATOR_CASE_EQUAL, OPERATOR_NOT_EQUAL, OPERATOR_MATCH,
+    OPERATOR_NOT_MATCH, OPERATOR_LESS, OPERATOR_LESS_EQUAL, OPERATOR_GREATER, OPERATOR_GREATER_EQUAL,
+    OPERATOR_SPACESHIP,
+    OPERATOR_NOT, OPERATOR_AND, OPERATOR_OR, OPERATOR_AND_ASSIGN, OPERATOR_OR_ASSIGN,
+    OPERATOR_BIT_AND, OPERATOR_BIT_OR, OPERATOR_BIT_XOR, OPERATOR_BIT_NOT, OPERATOR_SHIFT_LEFT,
+    OPERATOR_SHIFT_RIGHT, OPERATOR_BIT_AND_ASSIGN, OPERATOR_BIT_OR_ASSIGN, OPERATOR_BIT_XOR_ASSIGN,
+    OPERATOR_SHIFT_LEFT_ASSIGN, OPERATOR_SHIFT_RIGHT_ASSIGN,
+    OPERATOR_SCOPE, OPERATOR_COLON, OPERATOR_DOT, OPERATOR_SAFE_NAVIGATION, OPERATOR_ARROW,
+    OPERATOR_LAMBDA, OPERATOR_QUESTION
+};
+
+constexpr int OPERATOR_COUNT = static_cast<int>(Operator::OPERATOR_QUESTION) + 1;
+
+// Indexed by Operator. Ranges (.. and ...) are token types of their own and are not listed.
+constexpr std::string_view operatorSpellings[OPERATOR_COUNT] = {
+    "",
+    "+", "-", "*", "**", "/", "%",
+    "+=", "-=", "*=", "**=", "/=", "%=",
+    "=", "==", "===", "!=", "=~", "!~", "<", "<=", ">", ">=", "<=>",
+    "!", "&&", "||", "&&=", "||=",
+    "&", "|", "^", "~", "<<", ">>", "&=", "|=", "^=", "<<=", ">>=",
+    "::", ":", ".", "&.", "=>", "->", "?"
+};
+
+// Longest-match trie over the spellings above, built at compile time. Operator bytes are folded
+// into a small alphabet so each node is one short row; the root row is the first-byte dispatch.
+constexpr std::string_view OPERATOR_ALPHABET = "+-*/%=!<>&|^~:.?";
+constexpr int OPERATOR_ALPHABET_SIZE = static_cast<int>(OPERATOR_ALPHABET.size());
+constexpr int OPERATOR_TRIE_MAX_NODES = 64;
+constexpr uint8_t NOT_OPERATOR_BYTE = 0xff;
+
+struct OperatorTrie {
+    std::array<uint8_t, 256> letter{};
+    std::array<std::array<uint8_t, OPERATOR_ALPHABET_SIZE>, OPERATOR_TRIE_MAX_NODES> next{};
+    std::array<Operator, OPERATOR_TRIE_MAX_NODES> accepts{};
+    int nodes = 1;
+};
+
+constexpr OperatorTrie buildOperatorTrie() {
+    OperatorTrie trie{};
+    for (auto& letter : trie.letter) letter = NOT_OPERATOR_BYTE;
+    for (int i = 0; i < OPERATOR_ALPHABET_SIZE; i++) {
+        trie.letter[static_cast<unsigned char>(OPERATOR_ALPHABET[i])] = static_cast<uint8_t>(i);
+    }
+    for (int i = 1; i < OPERATOR_COUNT; i++) {
+        int node = 0;
+        for (char c : operatorSpellings[i]) {
+            uint8_t letter = trie.letter[static_cast<unsigned char>(c)];
+            if (trie.next[node][letter] == 0) trie.next[node][letter] = static_cast<uint8_t>(trie.nodes++);
+            node = trie.next[node][letter];
+        }
+        trie.accepts[node] = static_cast<Operator>(i);
+    }
+    return trie;
+}
+
+constexpr OperatorTrie operatorTrie = buildOperatorTrie();
+
+struct OperatorMatch {
+    Operator op = Operator::NOT_OPERATOR;
+    size_t length = 0;
+};
+
+// Longest operator at the front of text; length 0 when text does not start with one.
+constexpr OperatorMatch matchOperator(std::string_view text) {
+    OperatorMatch match;
+    int node = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        uint8_t letter = operatorTrie.letter[static_cast<unsigned char>(text[i])];
+        if (letter == NOT_OPERATOR_BYTE || operatorTrie.next[node][letter] == 0) break;
+        node = operatorTrie.next[node][letter];
+        if (operatorTrie.accepts[node] != Operator::NOT_OPERATOR) match = {operatorTrie.accepts[node], i + 1};
+    }
+    return match;
+}
+
+// Every prefix of an operator is itself an operator, so a match never reads more than one byte
+// past its end; incremental relexing and chunk boundaries rely on that one-byte lookahead.
+constexpr bool operatorPrefixesAreOperators() {
+    for (int i = 1; i < OPERATOR_COUNT; i++) {
+        std::string_view spelling = operatorSpellings[i];
+        for (size_t n = 1; n <= spelling.size(); n++) {
+            if (matchOperator(spelling.substr(0, n)).length != n) return false;
+        }
+    }
+    return true;
+}
+
+static_assert(buildOperatorTrie().nodes <= OPERATOR_TRIE_MAX_NODES, "operator trie is too small");
+static_assert(operatorPrefixesAreOperators(), "operator set needs more than one byte of lookahead");
+static_assert(matchOperator("<=>").op == Operator::OPERATOR_SPACESHIP, "operator trie is broken");
+static_assert(matchOperator("**=x").length == 3, "operator trie is broken");
+static_assert(matchOperator("&.").op == Operator::OPERATOR_SAFE_NAVIGATION, "operator trie is broken");
+static_assert(matchOperator("@").length == 0, "operator trie is broken");
+
+// Decoded value of a NUMBER_INT or NUMBER_HEX token (integer) or a NUMBER_FLOAT token (real).
+union NumberValue {
+    int64_t integer = 0;
+    double real;
+};
+
+struct NumberLiteral {
+    TokenType type = TokenType::UNKNOWN;   // UNKNOWN when the literal is malformed
+    size_t length = 0;
+    NumberValue value;
+    bool bigInteger = false;   // an integer too large for int64; value is 0, the lexeme is exact
+};
+
+constexpr bool isNumberType(TokenType type) {
+    return type == TokenType::NUMBER_INT || type == TokenType::NUMBER_FLOAT || type == TokenType::NUMBER_HEX;
+}
+
+// Value of c as a digit in bases up to 36; 36 or more when it is not one.
+constexpr unsigned digitValue(char c) {
+    unsigned decimal = static_cast<unsigned char>(c) - '0';
+    unsigned letter = (static_cast<unsigned char>(c) | 0x20) - 'a';
+    return decimal < 10 ? decimal : letter < 26 ? letter + 10 : 36;
+}
+
+constexpr bool isDigitIn(char c, int base) { return digitValue(c) < static_cast<unsigned>(base); }
+
+// Eight ASCII digits, the first in the lowest byte, to their value in three multiply steps.
+inline uint64_t parseEightDigits(const char* digits) {
+    uint64_t chunk;
+    std::memcpy(&chunk, digits, sizeof(chunk));
+    chunk -= 0x3030303030303030ull;
+    chunk = (chunk * 10 + (chunk >> 8)) & 0x00FF00FF00FF00FFull;
+    chunk = (chunk * 100 + (chunk >> 16)) & 0x0000FFFF0000FFFFull;
+    return (chunk * 10000 + (chunk >> 32)) & 0xFFFFFFFFull;
+}
+
+// Decimal digits to an int64, eight at a time. More than 19 significant digits, or 19 that
+// sort above INT64_MAX, overflow; below that the sum cannot wrap a uint64.
+inline bool parseDecimal(std::string_view digits, int64_t& value) {
+    while (digits.size() > 1 && digits.front() == '0') digits.remove_prefix(1);
+    constexpr std::string_view INT64_MAX_DIGITS = "9223372036854775807";
+    if (digits.size() > INT64_MAX_DIGITS.size()) return false;
+    if (digits.size() == INT64_MAX_DIGITS.size() && digits > INT64_MAX_DIGITS) return false;
+    uint64_t sum = 0;
+    size_t i = 0;
+    for (; i + 8 <= digits.size(); i += 8) sum = sum * 100000000 + parseEightDigits(digits.data() + i);
+    for (; i < digits.size(); i++) sum = sum * 10 + static_cast<uint64_t>(digits[i] - '0');
+    value = static_cast<int64_t>(sum);
+    return true;
+}
+
+// Decimal digits with an optional fraction and exponent to the nearest double. A mantissa of
+// at most 15 digits scaled by a power of ten up to 1e22 is exact on both sides, so one
+// multiply or divide rounds correctly (Clinger's fast path); anything else goes to from_chars.
+inline double parseFloat(std::string_view digits) {
+    static constexpr double POWERS_OF_TEN[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    auto isDecimal = [](char c) { return c >= '0' && c <= '9'; };
+    uint64_t mantissa = 0;
+    int significant = 0;
+    int scale = 0;
+    size_t i = 0;
+    for (; i < digits.size() && isDecimal(digits[i]); i++) {
+        mantissa = mantissa * 10 + static_cast<uint64_t>(digits[i] - '0');
+        significant += mantissa != 0;
+    }
+    if (i < digits.size() && digits[i] == '.') {
+        for (i++; i < digits.size() && isDecimal(digits[i]); i++, scale--) {
+            mantissa = mantissa * 10 + static_cast<uint64_t>(digits[i] - '0');
+            significant += mantissa != 0;
+        }
+    }
+    if (i < digits.size()) {
+        bool negative = digits[++i] == '-';
+        i += digits[i] == '+' || negative;
+        int exponent = 0;
+        for (; i < digits.size() && exponent < 100000; i++) exponent = exponent * 10 + (digits[i] - '0');
+        scale += negative ? -exponent : exponent;
+    }
+    if (significant <= 15 && scale >= -22 && scale <= 22) {
+        double value = static_cast<double>(mantissa);
+        return scale < 0 ? value / POWERS_OF_TEN[-scale] : value * POWERS_OF_TEN[scale];
+    }
+    double value = 0;
+    auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+    if (error == std::errc::result_out_of_range) value = scale < 0 ? 0.0 : std::numeric_limits<double>::infinity();
+    return value;
+}
+
+// Decodes the digits of a literal, prefix and separators removed, into literal. Digits that do
+// not fit the base make it UNKNOWN; the scan takes any decimal digit after 0b, 0o or a leading 0.
+inline void decodeNumberBody(NumberLiteral& literal, std::string_view body, int base, bool isFloat) {
+    if (isFloat) {
+        literal.type = TokenType::NUMBER_FLOAT;
+        literal.value.real = parseFloat(body);
+        return;
+    }
+    if (base == 10) {
+        literal.bigInteger = !parseDecimal(body, literal.value.integer);
+    } else {
+        uint64_t value = 0;
+        for (char c : body) {
+            unsigned digit = digitValue(c);
+            if (digit >= static_cast<unsigned>(base)) {
+                literal.type = TokenType::UNKNOWN;
+                return;
+            }
+            literal.bigInteger |= __builtin_mul_overflow(value, static_cast<uint64_t>(base), &value);
+            literal.bigInteger |= __builtin_add_overflow(value, digit, &value);
+        }
+        literal.bigInteger |= value > static_cast<uint64_t>(INT64_MAX);
+        literal.value.integer = static_cast<int64_t>(value);
+    }
+    if (literal.bigInteger) literal.value.integer = 0;
+}
+
+// Separators go between two digits only; strips them and decodes what is left. Kept out of
+// line so the common literal, without separators, never sets up a string.
+inline void decodeSeparatedBody(NumberLiteral& literal, std::string_view body, int base, bool isFloat) {
+    int digitBase = base == 16 ? 16 : 10;
+    std::string stripped;
+    stripped.reserve(body.size());
+    for (size_t k = 0; k < body.size(); k++) {
+        if (body[k] != '_') {
+            stripped.push_back(body[k]);
+        } else if (k == 0 || k + 1 == body.size() || !isDigitIn(body[k - 1], digitBase) || !isDigitIn(body[k + 1], digitBase)) {
+            literal.type = TokenType::UNKNOWN;
+            return;
+        }
+    }
+    decodeNumberBody(literal, stripped, base, isFloat);
+}
+
+// Scans the numeric literal at the front of text, which starts with a digit, and decodes it:
+// decimal with '_' separators, an optional fraction and exponent; 0x, 0b, 0o and 0d prefixes;
+// and a leading 0 for octal. A separator must sit between two digits and a digit must fit its
+// base, or the whole literal is UNKNOWN. The scan reads at most one byte past the literal.
+inline NumberLiteral scanNumberLiteral(std::string_view text) {
+    const char* const end = text.data() + text.size();
+    auto isDecimal = [](char c) { return static_cast<unsigned char>(c - '0') < 10; };
+    auto byteAt = [end](const char* p) { return p < end ? *p : '\0'; };
+
+    NumberLiteral literal;
+    literal.type = TokenType::NUMBER_INT;
+    int base = 10;
+    const char* digits = text.data();
+    const char* p = digits + 1;
+    bool separated = false;
+    if (*digits == '0') {
+        char prefix = static_cast<char>(byteAt(p) | 0x20);
+        if (prefix == 'x' || prefix == 'b' || prefix == 'o' || prefix == 'd') {
+            base = prefix == 'x' ? 16 : prefix == 'b' ? 2 : prefix == 'o' ? 8 : 10;
+            if (base == 16) literal.type = TokenType::NUMBER_HEX;
+            digits = ++p;
+        } else if (isDecimal(byteAt(p)) || byteAt(p) == '_') {
+            base = 8;
+        }
+    }
+
+    bool isFloat = false;
+    auto skipDecimal = [&] {
+        for (; p < end && (isDecimal(*p) || *p == '_'); p++) separated |= *p == '_';
+    };
+    if (base == 16) {
+        for (; p < end && (digitValue(*p) < 16 || *p == '_'); p++) separated |= *p == '_';
+    } else if (digits != text.data()) {
+        skipDecimal();
+    } else {
+        skipDecimal();
+        if (byteAt(p) == '.' && isDecimal(byteAt(p + 1))) {
+            isFloat = true;
+            p++;
+            skipDecimal();
+        }
+        char next = byteAt(p + 1);
+        if ((byteAt(p) | 0x20) == 'e' && (isDecimal(next) || next == '+' || next == '-')) {
+            isFloat = true;
+            p += next == '+' || next == '-' ? 2 : 1;
+            if (!isDecimal(byteAt(p))) {
+                literal.type = TokenType::UNKNOWN;
+                literal.length = p - text.data();
+                return literal;
+            }
+            skipDecimal();
+        }
+    }
+    literal.length = p - text.data();
+
+    std::string_view body(digits, p - digits);
+    if (body.empty()) {
+        literal.type = TokenType::UNKNOWN;
+    } else if (!separated) {
+        decodeNumberBody(literal, body, base, isFloat);
+    } else {
+        decodeSeparatedBody(literal, body, base, isFloat);
+    }
+    return literal;
+}
+
+struct Token {
+    TokenType type;
+    std::string lexeme; 
+    int line;           
+    Keyword keyword = Keyword::NOT_KEYWORD;
+    Operator op = Operator::NOT_OPERATOR;
+    bool bigInteger = false;
+    NumberValue number{};
+};
+
+// Allocation-free token: the lexeme points into the source buffer, which must outlive it.
+struct TokenView {
+    TokenType type;
+    std::string_view lexeme;
+    int line;
+    Keyword keyword = Keyword::NOT_KEYWORD;
+    Operator op = Operator::NOT_OPERATOR;
+    bool bigInteger = false;   // see NumberLiteral
+    NumberValue number{};      // NUMBER_* tokens only
+
+    Token materialize() const { return {type, std::string(lexeme), line, keyword, op, bigInteger, number}; }
+};
+
+// A byte that, with the type, restores what a token carries beyond its lexeme: the Keyword or
+// Operator id, or 1 for a big integer. TokenBuffer and the token cache store it per token.
+inline uint8_t tokenDetail(const TokenView& token) {
+    if (token.type == TokenType::KEYWORD) return static_cast<uint8_t>(token.keyword);
+    if (token.type == TokenType::OPERATOR) return static_cast<uint8_t>(token.op);
+    return isNumberType(token.type) && token.bigInteger;
+}
+
+inline std::vector<Token> materialize(const std::vector<TokenView>& views) {
+    std::vector<Token> tokens;
+    tokens.reserve(views.size());
+    for (const auto& view : views) {
+        tokens.push_back(view.materialize());
+    }
+    return tokens;
+}
+
+// Whether two tokens carry the same decoded number; tokens that are not numbers always do.
+inline bool sameNumber(const TokenView& a, const TokenView& b) {
+    if (a.type == TokenType::NUMBER_FLOAT) return a.number.real == b.number.real;
+    if (isNumberType(a.type)) return a.number.integer == b.number.integer && a.bigInteger == b.bigInteger;
+    return true;
+}
+
+// Indexed by TokenType.
+constexpr std::string_view tokenTypeNames[] = {
+    "NUMBER_INT",
+    "NUMBER_FLOAT",
+    "NUMBER_HEX",
+    "STRING_LITERAL",
+    "STRING_FRAGMENT",
+    "INTERPOLATION_BEGIN",
+    "INTERPOLATION_END",
+    "HEREDOC_BEGIN",
+    "HEREDOC_END",
+    "IDENTIFIER_LOCAL",
+    "IDENTIFIER_INSTANCE",
+    "IDENTIFIER_CLASS",
+    "IDENTIFIER_GLOBAL",
+    "CONSTANT",
+    "SYMBOL",
+    "KEYWORD",
+    "OPERATOR",
+    "SEPARATOR",
+    "COMMENT",
+    "RANGE_INCLUSIVE",
+    "RANGE_EXCLUSIVE",
+    "UNKNOWN",
+    "END_OF_FILE"
+};
+
+constexpr std::string_view tokenTypeToString(TokenType type) {
+    size_t index = static_cast<size_t>(type);
+    if (index < std::size(tokenTypeNames)) {
+        return tokenTypeNames[index];
+    }
+    return "INVALID_TOKEN_TYPE";
+}
+
+// Byte classes, looked up in one table instead of calling <cctype>, which is undefined for
+// the negative chars that non-ASCII bytes become. Ruby lets any non-ASCII character into a
+// name, so every byte of a multi-byte UTF-8 character is a word byte; whether the bytes
+// form well-formed characters is checked separately (see isWellFormedUtf8()).
+enum ByteClass : uint8_t {
+    BYTE_LOWER = 1 << 0,
+    BYTE_UPPER = 1 << 1,
+    BYTE_DIGIT = 1 << 2,
+    BYTE_UNDERSCORE = 1 << 3,
+    BYTE_SPACE = 1 << 4,
+    BYTE_NON_ASCII = 1 << 5,
+    BYTE_WORD_START = BYTE_LOWER | BYTE_UPPER | BYTE_UNDERSCORE | BYTE_NON_ASCII,
+    BYTE_WORD = BYTE_WORD_START | BYTE_DIGIT
+};
+
+constexpr std::array<uint8_t, 256> buildByteClasses() {
+    std::array<uint8_t, 256> classes{};
+    for (int c = 'a'; c <= 'z'; c++) classes[c] = BYTE_LOWER;
+    for (int c = 'A'; c <= 'Z'; c++) classes[c] = BYTE_UPPER;
+    for (int c = '0'; c <= '9'; c++) classes[c] = BYTE_DIGIT;
+    classes['_'] = BYTE_UNDERSCORE;
+    for (int c = '\t'; c <= '\r'; c++) classes[c] = BYTE_SPACE;
+    classes[' '] = BYTE_SPACE;
+    for (int c = 0x80; c < 256; c++) classes[c] = BYTE_NON_ASCII;
+    return classes;
+}
+
+inline constexpr std::array<uint8_t, 256> byteClasses = buildByteClasses();
+
+constexpr bool hasByteClass(char c, uint8_t mask) { return byteClasses[static_cast<unsigned char>(c)] & mask; }
+constexpr bool isIdentifierByte(char c) { return hasByteClass(c, BYTE_WORD); }
+constexpr bool isWordStartByte(char c) { return hasByteClass(c, BYTE_WORD_START); }
+constexpr bool isDigitByte(char c) { return hasByteClass(c, BYTE_DIGIT); }
+constexpr bool isSpaceByte(char c) { return hasByteClass(c, BYTE_SPACE); }
+
+// Length of the well-formed UTF-8 character at `p`, or 0 when the bytes there are not one:
+// a stray continuation byte, an overlong form, a surrogate, a code point past U+10FFFF or a
+// sequence cut short by `end`.
+inline size_t utf8CharLength(const char* p, const char* end) {
+    auto byte = [p](size_t i) { return static_cast<unsigned char>(p[i]); };
+    auto continues = [&](size_t i) { return p + i < end && (byte(i) & 0xC0) == 0x80; };
+    unsigned char lead = byte(0);
+    if (lead < 0x80) return 1;
+    if (lead < 0xC2) return 0;
+    if (lead < 0xE0) return continues(1) ? 2 : 0;
+    if (lead < 0xF0) {
+        if (!continues(1) || !continues(2)) return 0;
+        if ((lead == 0xE0 && byte(1) < 0xA0) || (lead == 0xED && byte(1) >= 0xA0)) return 0;
+        return 3;
+    }
+    if (lead < 0xF5) {
+        if (!continues(1) || !continues(2) || !continues(3)) return 0;
+        if ((lead == 0xF0 && byte(1) < 0x90) || (lead == 0xF4 && byte(1) >= 0x90)) return 0;
+        return 4;
+    }
+    return 0;
+}
+
+// Code point of a well-formed character of `length` bytes.
+inline uint32_t decodeUtf8(const char* p, size_t length) {
+    auto byte = [p](size_t i) { return static_cast<uint32_t>(static_cast<unsigned char>(p[i])); };
+    switch (length) {
+        case 1: return byte(0);
+        case 2: return (byte(0) & 0x1F) << 6 | (byte(1) & 0x3F);
+        case 3: return (byte(0) & 0x0F) << 12 | (byte(1) & 0x3F) << 6 | (byte(2) & 0x3F);
+        default: return (byte(0) & 0x07) << 18 | (byte(1) & 0x3F) << 12 | (byte(2) & 0x3F) << 6 | (byte(3) & 0x3F);
+    }
+}
+
+// Uppercase letters outside ASCII, for telling a constant from a local name. This covers the
+// Latin, Greek, Cyrillic, Armenian and Georgian capitals and the fullwidth Latin ones, not
+// the whole Unicode database; a `step` of 2 takes every other code point from `first`.
+struct UppercaseRange {
+    uint32_t first;
+    uint32_t last;
+    uint32_t step;
+};
+
+constexpr UppercaseRange uppercaseRanges[] = {
+    {0x00C0, 0x00D6, 1}, {0x00D8, 0x00DE, 1}, {0x0100, 0x0136, 2}, {0x0139, 0x0147, 2},
+    {0x014A, 0x0176, 2}, {0x0178, 0x0179, 1}, {0x017B, 0x017D, 2}, {0x0391, 0x03A1, 1},
+    {0x03A3, 0x03AB, 1}, {0x0400, 0x042F, 1}, {0x0460, 0x0480, 2}, {0x048A, 0x04BE, 2},
+    {0x04D0, 0x052E, 2}, {0x0531, 0x0556, 1}, {0x10A0, 0x10C5, 1}, {0x1E00, 0x1E94, 2},
+    {0x1EA0, 0x1EFE, 2}, {0xFF21, 0xFF3A, 1}
+};
+
+inline bool isUppercaseCodePoint(uint32_t code) {
+    for (const UppercaseRange& range : uppercaseRanges) {
+        if (code >= range.first && code <= range.last) return (code - range.first) % range.step == 0;
+    }
+    return false;
+}
+
+// Whether a name starts with a capital, which makes it a constant. ASCII takes the table;
+// only a multi-byte first character is decoded.
+inline bool startsUppercase(std::string_view word) {
+    if (word.empty()) return false;
+    if (!hasByteClass(word[0], BYTE_NON_ASCII)) return hasByteClass(word[0], BYTE_UPPER);
+    size_t length = utf8CharLength(word.data(), word.data() + word.size());
+    return length && isUppercaseCodePoint(decodeUtf8(word.data(), length));
+}
+
+// Byte-scanning kernels for the lexers' hot loops. Each returns the first position in
+// [p, end) that ends the loop, never reading past `end`; lineStarts* instead appends the
+// offset after every newline, and validUtf8* says whether [p, end) is well-formed UTF-8.
+// The scalar versions define the behaviour; the SSE2 and AVX2 versions classify 16 or 32
+// bytes per step and must agree with them byte for byte. ScanKernels::best() picks one set
+// at startup.
+
+inline const char* identifierEndScalar(const char* p, const char* end) {
+    while (p < end && isIdentifierByte(*p)) p++;
+    return p;
+}
+
+inline const char* findFirstOfScalar(const char* p, const char* end, char a, char b, char c) {
+    while (p < end && *p != a && *p != b && *p != c) p++;
+    return p;
+}
+
+inline const char* skipWhitespaceScalar(const char* p, const char* end, int& newlines) {
+    while (p < end && isSpaceByte(*p)) {
+        newlines += *p == '\n';
+        p++;
+    }
+    return p;
+}
+
+// Offsets are relative to `base`, which is where [p, end) or an earlier part of it starts.
+inline void lineStartsScalar(const char* base, const char* p, const char* end, std::vector<uint32_t>& starts) {
+    for (; p < end; p++) {
+        if (*p == '\n') starts.push_back(static_cast<uint32_t>(p - base + 1));
+    }
+}
+
+inline bool validUtf8Scalar(const char* p, const char* end) {
+    while (p < end) {
+        size_t length = utf8CharLength(p, end);
+        if (!length) return false;
+        p += length;
+    }
+    return true;
+}
+
+// Needles looked for all at once, after the Teddy scheme: each needle falls in one of eight
+// buckets by its first byte, and for the first two bytes of a needle, tables indexed by a
+// byte's low and high nibble hold the bits of the buckets with that byte there. Where the four
+// lookups at a position share a bit, a needle of that bucket may start there and is compared
+// in full. A one-byte needle puts its bit everywhere in the second tables. The needles must
+// outlive the set and must not be empty.
+class SubstringSet {
+public:
+    static constexpr unsigned BUCKETS = 8;
+
+    void add(std::string_view needle) {
+        unsigned bucket = static_cast<uint8_t>(needle[0]) % BUCKETS;
+        uint8_t bit = static_cast<uint8_t>(1u << bucket);
+        buckets[bucket].push_back(needle);
+        mark(0, static_cast<uint8_t>(needle[0]), bit);
+        if (needle.size() > 1) {
+            mark(1, static_cast<uint8_t>(needle[1]), bit);
+        } else {
+            for (unsigned i = 0; i < 16; i++) {
+                low[1][i] |= bit;
+                high[1][i] |= bit;
+            }
+        }
+    }
+
+    // The buckets whose needles may start at p.
+    unsigned candidatesAt(const char* p, const char* end) const {
+        uint8_t first = static_cast<uint8_t>(p[0]);
+        unsigned found = low[0][first & 15] & high[0][first >> 4];
+        if (p + 1 < end) {
+            uint8_t second = static_cast<uint8_t>(p[1]);
+            found &= low[1][second & 15] & high[1][second >> 4];
+        }
+        return found;
+    }
+
+    bool matchesAt(const char* p, const char* end, unsigned candidates) const {
+        for (; candidates; candidates &= candidates - 1) {
+            for (std::string_view needle : buckets[__builtin_ctz(candidates)]) {
+                if (needle.size() <= static_cast<size_t>(end - p) && std::memcmp(p, needle.data(), needle.size()) == 0) return true;
+            }
+        }
+        return false;
+    }
+
+    alignas(16) uint8_t low[2][16] = {};
+    alignas(16) uint8_t high[2][16] = {};
+
+private:
+    void mark(int at, uint8_t byte, uint8_t bit) {
+        low[at][byte & 15] |= bit;
+        high[at][byte >> 4] |= bit;
+    }
+
+    std::vector<std::string_view> buckets[BUCKETS];
+};
+
+inline bool containsAnyScalar(const char* p, const char* end, const SubstringSet& needles) {
+    for (; p < end; p++) {
+        unsigned candidates = needles.candidatesAt(p, end);
+        if (candidates && needles.matchesAt(p, end, candidates)) return true;
+    }
+    return false;
+}
+
+// For the short lexeme of a single name, where setting up a vector pass does not pay.
+inline bool isWellFormedUtf8(std::string_view text) {
+    return validUtf8Scalar(text.data(), text.data() + text.size());
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+inline __m128i identifierMask128(__m128i v) {
+    // Bytes >= 0x80 are negative as signed chars and fall outside every range below; the
+    // sign test adds them back.
+    __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+                                   _mm_cmplt_epi8(folded, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i underscore = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+    __m128i nonAscii = _mm_cmplt_epi8(v, _mm_setzero_si128());
+    return _mm_or_si128(_mm_or_si128(letter, digit), _mm_or_si128(underscore, nonAscii));
+}
+
+__attribute__((target("sse2")))
+inline __m128i spaceMask128(__m128i v) {
+    __m128i control = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)),
+                                    _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1)));
+    return _mm_or_si128(control, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+}
+
+__attribute__((target("sse2")))
+inline const char* identifierEndSse2(const char* p, const char* end) {
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        unsigned stop = ~_mm_movemask_epi8(identifierMask128(v)) & 0xFFFFu;
+        if (stop) return p + __builtin_ctz(stop);
+    }
+    return identifierEndScalar(p, end);
+}
+
+__attribute__((target("sse2")))
+inline const char* findFirstOfSse2(const char* p, const char* end, char a, char b, char c) {
+    __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), vc = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)), _mm_cmpeq_epi8(v, vc));
+        unsigned found = _mm_movemask_epi8(hit);
+        if (found) return p + __builtin_ctz(found);
+    }
+    return findFirstOfScalar(p, end, a, b, c);
+}
+
+__attribute__((target("sse2")))
+inline const char* skipWhitespaceSse2(const char* p, const char* end, int& newlines) {
+    __m128i newline = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        unsigned stop = ~_mm_movemask_epi8(spaceMask128(v)) & 0xFFFFu;
+        unsigned lines = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        if (stop) {
+            unsigned offset = __builtin_ctz(stop);
+            newlines += __builtin_popcount(lines & ((1u << offset) - 1));
+            return p + offset;
+        }
+        newlines += __builtin_popcount(lines);
+    }
+    return skipWhitespaceScalar(p, end, newlines);
+}
+
+__attribute__((target("sse2")))
+inline void lineStartsSse2(const char* base, const char* p, const char* end, std::vector<uint32_t>& starts) {
+    __m128i newline = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        unsigned found = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        uint32_t offset = static_cast<uint32_t>(p - base + 1);
+        for (; found; found &= found - 1) starts.push_back(offset + __builtin_ctz(found));
+    }
+    lineStartsScalar(base, p, end, starts);
+}
+
+// Skips ASCII 16 bytes at a time and checks each multi-byte character with the scalar code.
+__attribute__((target("sse2")))
+inline bool validUtf8Sse2(const char* p, const char* end) {
+    while (p < end) {
+        if (end - p >= 16) {
+            unsigned nonAscii = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+            if (!nonAscii) {
+                p += 16;
+                continue;
+            }
+            p += __builtin_ctz(nonAscii);
+        }
+        size_t length = utf8CharLength(p, end);
+        if (!length) return false;
+        p += length;
+    }
+    return true;
+}
+
+__attribute__((target("avx2")))
+inline __m256i identifierMask256(__m256i v) {
+    __m256i folded = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(folded, _mm256_set1_epi8('a' - 1)),
+                                      _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), folded));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    __m256i underscore = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+    __m256i nonAscii = _mm256_cmpgt_epi8(_mm256_setzero_si256(), v);
+    return _mm256_or_si256(_mm256_or_si256(letter, digit), _mm256_or_si256(underscore, nonAscii));
+}
+
+__attribute__((target("avx2")))
+inline __m256i spaceMask256(__m256i v) {
+    __m256i control = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t' - 1)),
+                                       _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), v));
+    return _mm256_or_si256(control, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+}
+
+__attribute__((target("avx2")))
+inline const char* identifierEndAvx2(const char* p, const char* end) {
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        uint32_t stop = ~static_cast<uint32_t>(_mm256_movemask_epi8(identifierMask256(v)));
+        if (stop) return p + __builtin_ctz(stop);
+    }
+    return identifierEndSse2(p, end);
+}
+
+__attribute__((target("avx2")))
+inline const char* findFirstOfAvx2(const char* p, const char* end, char a, char b, char c) {
+    __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b), vc = _mm256_set1_epi8(c);
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+                                      _mm256_cmpeq_epi8(v, vc));
+        uint32_t found = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+        if (found) return p + __builtin_ctz(found);
+    }
+    return findFirstOfSse2(p, end, a, b, c);
+}
+
+__attribute__((target("avx2")))
+inline const char* skipWhitespaceAvx2(const char* p, const char* end, int& newlines) {
+    __m256i newline = _mm256_set1_epi8('\n');
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        uint32_t stop = ~static_cast<uint32_t>(_mm256_movemask_epi8(spaceMask256(v)));
+        uint32_t lines = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline)));
+        if (stop) {
+            unsigned offset = __builtin_ctz(stop);
+            newlines += __builtin_popcount(lines & ((1u << offset) - 1));
+            return p + offset;
+        }
+        newlines += __builtin_popcount(lines);
+    }
+    return skipWhitespaceSse2(p, end, newlines);
+}
+
+__attribute__((target("avx2")))
+inline void lineStartsAvx2(const char* base, const char* p, const char* end, std::vector<uint32_t>& starts) {
+    __m256i newline = _mm256_set1_epi8('\n');
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        uint32_t found = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline)));
+        uint32_t offset = static_cast<uint32_t>(p - base + 1);
+        for (; found; found &= found - 1) starts.push_back(offset + __builtin_ctz(found));
+    }
+    lineStartsSse2(base, p, end, starts);
+}
+
+__attribute__((target("avx2")))
+inline __m256i lookupNibbles(const uint8_t (&table)[16], __m256i nibbles) {
+    __m256i repeated = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(table)));
+    return _mm256_shuffle_epi8(repeated, nibbles);
+}
+
+// The block's bytes shifted right by N, the first N taken from the end of `previous`.
+template <int N>
+__attribute__((target("avx2")))
+inline __m256i previousBytes(__m256i input, __m256i previous) {
+    return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - N);
+}
+
+// Keiser and Lemire's lookup validation of one block. Each error a pair of adjacent bytes
+// can show sets one bit in all three tables: the high and low nibble of the first byte and
+// the high nibble of the second. Continuations that a lead two or three bytes back expects
+// are checked by saturating subtraction; the TWO_CONTS bit, set when a continuation follows
+// a continuation, must then match them exactly.
+__attribute__((target("avx2")))
+inline __m256i utf8BlockErrors(__m256i input, __m256i previous) {
+    constexpr uint8_t TOO_SHORT = 1 << 0, TOO_LONG = 1 << 1, OVERLONG_3 = 1 << 2, TOO_LARGE = 1 << 3,
+                      SURROGATE = 1 << 4, OVERLONG_2 = 1 << 5, TOO_LARGE_1000 = 1 << 6, OVERLONG_4 = 1 << 6,
+                      TWO_CONTS = 1 << 7, CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+    static constexpr uint8_t firstHigh[16] = {
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+    };
+    static constexpr uint8_t firstLow[16] = {
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY, CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000
+    };
+    static constexpr uint8_t secondHigh[16] = {
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+    };
+
+    const __m256i lowNibble = _mm256_set1_epi8(0x0F);
+    __m256i prev1 = previousBytes<1>(input, previous);
+    __m256i special = _mm256_and_si256(
+        _mm256_and_si256(lookupNibbles(firstHigh, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), lowNibble)),
+                         lookupNibbles(firstLow, _mm256_and_si256(prev1, lowNibble))),
+        lookupNibbles(secondHigh, _mm256_and_si256(_mm256_srli_epi16(input, 4), lowNibble)));
+
+    __m256i thirdOfThree = _mm256_subs_epu8(previousBytes<2>(input, previous), _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+    __m256i fourthOfFour = _mm256_subs_epu8(previousBytes<3>(input, previous), _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+    __m256i mustContinue = _mm256_and_si256(_mm256_or_si256(thirdOfThree, fourthOfFour), _mm256_set1_epi8(static_cast<char>(0x80)));
+    return _mm256_xor_si256(mustContinue, special);
+}
+
+__attribute__((target("avx2")))
+inline void checkUtf8Block(__m256i input, __m256i& previous, __m256i& incomplete, __m256i& errors) {
+    // Non-zero where one of the last three bytes starts a character longer than the block has left.
+    const __m256i tailLimit = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                               -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                               static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+    if (_mm256_movemask_epi8(input) == 0) {
+        errors = _mm256_or_si256(errors, incomplete);
+        incomplete = _mm256_setzero_si256();
+    } else {
+        errors = _mm256_or_si256(errors, utf8BlockErrors(input, previous));
+        incomplete = _mm256_subs_epu8(input, tailLimit);
+    }
+    previous = input;
+}
+
+__attribute__((target("avx2")))
+inline bool validUtf8Avx2(const char* p, const char* end) {
+    __m256i previous = _mm256_setzero_si256(), incomplete = _mm256_setzero_si256(), errors = _mm256_setzero_si256();
+    for (; end - p >= 32; p += 32) {
+        checkUtf8Block(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), previous, incomplete, errors);
+    }
+    // The tail is padded with NULs, which are ASCII and so flag any character it cuts short.
+    alignas(32) char tail[32] = {};
+    std::memcpy(tail, p, end - p);
+    checkUtf8Block(_mm256_load_si256(reinterpret_cast<const __m256i*>(tail)), previous, incomplete, errors);
+    errors = _mm256_or_si256(errors, incomplete);
+    return _mm256_testz_si256(errors, errors);
+}
+
+__attribute__((target("avx2")))
+inline __m256i nibbleLookup256(const uint8_t (&table)[16], __m256i nibbles) {
+    return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(table))), nibbles);
+}
+
+// Looks the 32 starts of a block up in the nibble tables with vpshufb and compares in full
+// only where a bucket bit survives.
+__attribute__((target("avx2")))
+inline bool containsAnyAvx2(const char* p, const char* end, const SubstringSet& needles) {
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    for (; end - p >= 33; p += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 1));
+        __m256i first = _mm256_and_si256(nibbleLookup256(needles.low[0], _mm256_and_si256(a, nibble)),
+                                         nibbleLookup256(needles.high[0], _mm256_and_si256(_mm256_srli_epi16(a, 4), nibble)));
+        __m256i second = _mm256_and_si256(nibbleLookup256(needles.low[1], _mm256_and_si256(b, nibble)),
+                                          nibbleLookup256(needles.high[1], _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble)));
+        __m256i found = _mm256_and_si256(first, second);
+        unsigned candidates = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(found, _mm256_setzero_si256()));
+        for (; candidates; candidates &= candidates - 1) {
+            const char* start = p + __builtin_ctz(candidates);
+            if (needles.matchesAt(start, end, needles.candidatesAt(start, end))) return true;
+        }
+    }
+    return containsAnyScalar(p, end, needles);
+}
+
+#endif
+
+struct ScanKernels {
+    const char* name;
+    const char* (*identifierEnd)(const char* p, const char* end);
+    const char* (*findFirstOf)(const char* p, const char* end, char a, char b, char c);
+    const char* (*skipWhitespace)(const char* p, const char* end, int& newlines);
+    void (*lineStarts)(const char* base, const char* p, const char* end, std::vector<uint32_t>& starts);
+    bool (*validUtf8)(const char* p, const char* end);
+    // Whether a needle of the set occurs in [p, end). SSE2 has no byte shuffle for the
+    // nibble lookups, so that set goes through the scalar loop.
+    bool (*containsAny)(const char* p, const char* end, const SubstringSet& needles);
+
+    // The widest set this CPU runs. LEXER_SIMD=scalar|sse2|avx2 narrows the choice, which
+    // is how the vector paths are checked against the scalar one.
+    static const ScanKernels& best() {
+        static const ScanKernels scalar = {"scalar", identifierEndScalar, findFirstOfScalar, skipWhitespaceScalar, lineStartsScalar, validUtf8Scalar, containsAnyScalar};
+#if defined(__x86_64__) || defined(__i386__)
+        static const ScanKernels sse2 = {"sse2", identifierEndSse2, findFirstOfSse2, skipWhitespaceSse2, lineStartsSse2, validUtf8Sse2, containsAnyScalar};
+        static const ScanKernels avx2 = {"avx2", identifierEndAvx2, findFirstOfAvx2, skipWhitespaceAvx2, lineStartsAvx2, validUtf8Avx2, containsAnyAvx2};
+        static const ScanKernels& chosen = [&]() -> const ScanKernels& {
+            const char* request = getenv("LEXER_SIMD");
+            std::string_view limit = request ? request : "avx2";
+            if (limit == "scalar") return scalar;
+            if (limit != "sse2" && __builtin_cpu_supports("avx2")) return avx2;
+            if (__builtin_cpu_supports("sse2")) return sse2;
+            return scalar;
+        }();
+        return chosen;
+#else
+        return scalar;
+#endif
+    }
+};
+
+// Where each line of a source starts, for turning byte offsets into 1-based lines and
+// columns. Built in one vectorized pass over the source, so lexers need not count lines
+// per token. Lookups are a binary search; a Cursor answers non-decreasing offsets in
+// amortized O(1). Columns count UTF-8 characters, not bytes.
+class LineIndex {
+public:
+    struct Location {
+        int line;
+        int column;
+    };
+
+    LineIndex() { starts.push_back(0); }
+    explicit LineIndex(std::string_view source) { build(source); }
+
+    void build(std::string_view newSource) {
+        source = newSource;
+        starts.clear();
+        starts.push_back(0);
+        ScanKernels::best().lineStarts(source.data(), source.data(), source.data() + source.size(), starts);
+    }
+
+    // Offsets at or past the end of the source fall on the last line.
+    int line(size_t offset) const {
+        return static_cast<int>(std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin());
+    }
+
+    int column(size_t offset) const { return columnOn(line(offset), offset); }
+    Location location(size_t offset) const {
+        int at = line(offset);
+        return {at, columnOn(at, offset)};
+    }
+
+    size_t lineCount() const { return starts.size(); }
+    size_t lineStart(int line) const { return starts[line - 1]; }
+    size_t memoryBytes() const { return starts.capacity() * sizeof(uint32_t); }
+
+    class Cursor {
+    public:
+        explicit Cursor(const LineIndex& index) : index(&index) {}
+
+        int line(size_t offset) {
+            const std::vector<uint32_t>& starts = index->starts;
+            if (offset < starts[current - 1]) current = index->line(offset);
+            while (current < starts.size() && starts[current] <= offset) current++;
+            return static_cast<int>(current);
+        }
+
+    private:
+        const LineIndex* index;
+        size_t current = 1;
+    };
+
+private:
+    std::string_view source;
+    std::vector<uint32_t> starts;
+
+    int columnOn(int line, size_t offset) const {
+        size_t from = starts[line - 1];
+        offset = std::min(offset, source.size());
+        int column = 1;
+        for (size_t i = from; i < offset; i++) column += (static_cast<unsigned char>(source[i]) & 0xC0) != 0x80;
+        return column;
+    }
+};
+
+// Where a lexer stands between code, strings and heredocs. Top-level code has an empty
+// stack. A double-quoted string cut by "#{" pushes STRING, the interpolation pushes
+// INTERPOLATION on top of it, and so on to any depth. Heredoc openers wait in `pending`
+// until their line ends, then their bodies are read one after another.
+struct LexMode {
+    enum Kind : uint8_t { STRING, INTERPOLATION, HEREDOC };
+    Kind kind = STRING;
+    char quote = 0;            // STRING: the closing quote
+    bool interpolates = true;  // HEREDOC: false for <<~'ID'
+    bool indented = false;     // HEREDOC: the terminator may be indented (<<~ and <<-)
+    uint32_t braces = 0;       // INTERPOLATION: '{' opened inside it and not yet closed
+    std::string id{};          // HEREDOC: the terminator
+};
+
+struct LexModes {
+    std::vector<LexMode> stack;
+    std::vector<LexMode> pending;
+    // Furthest index a heredoc scan has read. Openers and terminators are recognized by
+    // reading past the end of the token they produce; streams must have those bytes, and
+    // edits there can change tokens already behind the lexer.
+    size_t reach = 0;
+
+    bool topLevel() const { return stack.empty() && pending.empty(); }
+    // Whether lexing may restart at `offset` in plain code with a fresh LexModes.
+    bool settledAt(size_t offset) const { return topLevel() && reach <= offset; }
+    bool inCode() const { return stack.empty() || stack.back().kind == LexMode::INTERPOLATION; }
+
+    // Called at the newline that ends a line with heredoc openers on it.
+    void beginHeredocBody() {
+        stack.push_back(std::move(pending.front()));
+        pending.erase(pending.begin());
+    }
+};
+
+inline bool opensInterpolation(std::string_view source, size_t p) {
+    return p + 1 < source.size() && source[p] == '#' && source[p + 1] == '{';
+}
+
+// Index of the closing quote, the "#{" (when `interpolates`) or the end of the source,
+// whichever comes first from `p`. A backslash escapes the byte after it.
+inline size_t stringContentEnd(std::string_view source, size_t p, char quote, bool interpolates, const ScanKernels& kernels) {
+    const char* const begin = source.data();
+    const size_t size = source.size();
+    while (true) {
+        p = kernels.findFirstOf(begin + p, begin + size, quote, '\\', interpolates ? '#' : quote) - begin;
+        if (p >= size || source[p] == quote) return p;
+        if (source[p] == '\\') p = std::min(p + 2, size);
+        else if (opensInterpolation(source, p)) return p;
+        else p++;
+    }
+}
+
+// Scans a string whose opening quote is at `start`. Returns STRING_LITERAL for a whole
+// string and UNKNOWN for one that runs off the end. A double-quoted string that reaches a
+// "#{" first yields its head as a STRING_FRAGMENT and goes on in STRING mode.
+inline TokenType scanQuotedString(std::string_view source, int start, int& current, LexModes& modes, const ScanKernels& kernels) {
+    char quote = source[start];
+    size_t end = stringContentEnd(source, start + 1, quote, quote == '"', kernels);
+    current = static_cast<int>(end);
+    if (end >= source.size()) return TokenType::UNKNOWN;
+    if (source[end] == quote) {
+        current++;
+        return TokenType::STRING_LITERAL;
+    }
+    modes.stack.push_back({LexMode::STRING, quote});
+    return TokenType::STRING_FRAGMENT;
+}
+
+// Length of the heredoc opener at `start` ("<<~ID", "<<-'ID'", "<<ID"), or 0 when the "<<"
+// there is an operator. The bare form needs a capital, '_' or a quote after it and must not
+// follow a value directly, so `1<<BITS` and `class << self` stay shifts. The body is
+// queued in `modes` until the line ends. Either way `modes.reach` records how far it read:
+// a quoted ID is looked for up to the end of the line.
+inline size_t scanHeredocStart(std::string_view source, size_t start, LexModes& modes) {
+    const size_t size = source.size();
+    size_t p = start + 2;
+    modes.reach = std::max(modes.reach, p);
+    if (p >= size || source[start] != '<' || source[start + 1] != '<') return 0;
+    bool indented = source[p] == '~' || source[p] == '-';
+    if (indented) {
+        modes.reach = std::max(modes.reach, ++p);
+        if (p >= size) return 0;
+    }
+    char quote = source[p] == '"' || source[p] == '\'' ? source[p] : 0;
+    size_t idStart = quote ? p + 1 : p;
+    size_t idEnd = idStart;
+    if (quote) {
+        while (idEnd < size && source[idEnd] != quote && source[idEnd] != '\n') idEnd++;
+        modes.reach = std::max(modes.reach, idEnd);
+        if (idEnd >= size || source[idEnd] != quote || idEnd == idStart) return 0;
+        p = idEnd + 1;
+    } else {
+        if (!hasByteClass(source[idStart], indented ? BYTE_WORD_START : BYTE_UPPER | BYTE_UNDERSCORE)) return 0;
+        while (idEnd < size && isIdentifierByte(source[idEnd])) idEnd++;
+        modes.reach = std::max(modes.reach, idEnd);
+        p = idEnd;
+    }
+    if (!indented && start > 0) {
+        char before = source[start - 1];
+        if (isIdentifierByte(before) || before == ')' || before == ']' || before == '}') return 0;
+    }
+    LexMode heredoc{LexMode::HEREDOC};
+    heredoc.interpolates = quote != '\'';
+    heredoc.indented = indented;
+    heredoc.id.assign(source.substr(idStart, idEnd - idStart));
+    modes.pending.push_back(std::move(heredoc));
+    return p - start;
+}
+
+// A heredoc body from `current`: the text up to its terminator line, a "#{" or the end as
+// a STRING_FRAGMENT, or the terminator itself as HEREDOC_END, for which `start` moves past
+// the indentation. A body with no terminator runs to the end as UNKNOWN.
+inline TokenType scanHeredocBody(std::string_view source, int& start, int& current, LexModes& modes, const ScanKernels& kernels) {
+    const LexMode& mode = modes.stack.back();
+    const size_t size = source.size();
+    size_t p = current;
+    bool lineStart = p == 0 || source[p - 1] == '\n';
+    while (p < size) {
+        if (lineStart) {
+            size_t idAt = p;
+            if (mode.indented) {
+                while (idAt < size && (source[idAt] == ' ' || source[idAt] == '\t')) idAt++;
+            }
+            size_t after = idAt + mode.id.size();
+            modes.reach = std::max(modes.reach, after);
+            if (source.compare(idAt, mode.id.size(), mode.id) == 0 && (after >= size || source[after] == '\n' || source[after] == '\r')) {
+                if (p > static_cast<size_t>(current)) {
+                    current = static_cast<int>(p);
+                    return TokenType::STRING_FRAGMENT;
+                }
+                start = static_cast<int>(idAt);
+                current = static_cast<int>(after);
+                modes.stack.pop_back();
+                return TokenType::HEREDOC_END;
+            }
+        }
+        p = kernels.findFirstOf(source.data() + p, source.data() + size, '\n', '\\', mode.interpolates ? '#' : '\n') - source.data();
+        if (p >= size) break;
+        lineStart = false;
+        if (source[p] == '\n') {
+            p++;
+            lineStart = true;
+        } else if (source[p] == '\\') {
+            p = std::min(p + 2, size);
+            lineStart = source[p - 1] == '\n';
+        } else if (opensInterpolation(source, p)) {
+            current = static_cast<int>(p);
+            return TokenType::STRING_FRAGMENT;
+        } else {
+            p++;
+        }
+    }
+    current = static_cast<int>(size);
+    modes.stack.pop_back();
+    return TokenType::UNKNOWN;
+}
+
+// The next token inside a string or heredoc body: a fragment, the "#{" opening an
+// interpolation, or the terminator. A string's last fragment takes its closing quote.
+inline TokenType scanStringMode(std::string_view source, int& start, int& current, LexModes& modes, const ScanKernels& kernels) {
+    const LexMode& mode = modes.stack.back();
+    if (mode.interpolates && opensInterpolation(source, current)) {
+        current += 2;
+        modes.stack.push_back({LexMode::INTERPOLATION});
+        return TokenType::INTERPOLATION_BEGIN;
+    }
+    if (mode.kind == LexMode::HEREDOC) return scanHeredocBody(source, start, current, modes, kernels);
+
+    size_t end = stringContentEnd(source, current, mode.quote, true, kernels);
+    current = static_cast<int>(end);
+    if (end >= source.size()) {
+        modes.stack.pop_back();
+        return TokenType::UNKNOWN;
+    }
+    if (source[end] == mode.quote) {
+        current++;
+        modes.stack.pop_back();
+    }
+    return TokenType::STRING_FRAGMENT;
+}
+
+// Type of a '{' or '}' in code: inside an interpolation the '}' matching its "#{" ends it.
+inline TokenType braceType(char brace, LexModes& modes) {
+    if (modes.stack.empty() || modes.stack.back().kind != LexMode::INTERPOLATION) return TokenType::SEPARATOR;
+    uint32_t& braces = modes.stack.back().braces;
+    if (brace == '{') {
+        braces++;
+    } else if (braces > 0) {
+        braces--;
+    } else {
+        modes.stack.pop_back();
+        return TokenType::INTERPOLATION_END;
+    }
+    return TokenType::SEPARATOR;
+}
+
+// Matching openers and closers, built one token at a time as a lexer emits them. Openers
+// are `class`, `module`, `def`, `case`, `begin`, `do` and `for`; `if`, `unless`, `while`
+// and `until` when they start a statement rather than modify one; '(', '[', '{' and "#{".
+// For every token it keeps the index of its partner, when it has one, and how many blocks
+// enclose it, so jumping to a match or asking for a token's depth is a lookup, like the
+// structural index of a JSON parser. Closers with nothing to close and openers left open
+// are collected on the way, so unbalanced input needs no second pass to find.
+class BlockIndex {
+public:
+    static constexpr uint32_t NO_PARTNER = UINT32_MAX;
+
+    // Starts over for tokens of `newSource`, whose lexemes must point into it.
+    void reset(std::string_view newSource) {
+        source = newSource;
+        partners.clear();
+        depths.clear();
+        open.clear();
+        strays.clear();
+        deepest = 0;
+        pairs = 0;
+        previousEnd = newSource.data();
+        statementStart = true;
+        afterName = false;
+        loopHead = false;
+        defHeader = false;
+    }
+
+    // Takes the next token. END_OF_FILE closes the index: whatever is still open then is
+    // unbalanced.
+    void add(const TokenView& token) {
+        const uint32_t index = static_cast<uint32_t>(partners.size());
+        partners.push_back(NO_PARTNER);
+        if (token.type == TokenType::END_OF_FILE) {
+            depths.push_back(static_cast<uint32_t>(open.size()));
+            for (const Open& opener : open) strays.push_back(opener.index);
+            open.clear();
+            std::sort(strays.begin(), strays.end());
+            return;
+        }
+
+        const char* at = token.lexeme.data();
+        if (at > previousEnd && std::memchr(previousEnd, '\n', at - previousEnd)) endStatement();
+        switch (roleOf(token)) {
+            case OPENS_BLOCK: openBlock(index, BLOCK, token); break;
+            case OPENS_PAREN: openBlock(index, PAREN, token); break;
+            case OPENS_BRACKET: openBlock(index, BRACKET, token); break;
+            case OPENS_BRACE: openBlock(index, BRACE, token); break;
+            case OPENS_INTERPOLATION: openBlock(index, INTERPOLATION, token); break;
+            case CLOSES_BLOCK: closeBlock(index, BLOCK); break;
+            case CLOSES_PAREN: closeBlock(index, PAREN); break;
+            case CLOSES_BRACKET: closeBlock(index, BRACKET); break;
+            case CLOSES_BRACE: closeBlock(index, BRACE); break;
+            case CLOSES_INTERPOLATION: closeBlock(index, INTERPOLATION); break;
+            case NO_ROLE:
+                depths.push_back(static_cast<uint32_t>(open.size()));
+                if (token.op == Operator::OPERATOR_ASSIGN) endlessDef(index, at);
+                break;
+        }
+        if (token.type == TokenType::SEPARATOR && token.lexeme[0] == ';') endStatement();
+        statementStart = startsStatement(token);
+        afterName = token.op == Operator::OPERATOR_DOT || token.op == Operator::OPERATOR_SAFE_NAVIGATION ||
+                    token.op == Operator::OPERATOR_SCOPE || token.keyword == Keyword::KEYWORD_DEF;
+        previousEnd = at + token.lexeme.size();
+    }
+
+    size_t size() const { return partners.size(); }
+    bool empty() const { return partners.empty(); }
+    uint32_t partner(size_t i) const { return partners[i]; }
+    // Blocks around token i; an opener and its closer sit at the depth outside them.
+    uint32_t depth(size_t i) const { return depths[i]; }
+    uint32_t maxDepth() const { return deepest; }
+    size_t pairCount() const { return pairs; }
+    // Indices of closers that closed nothing and openers never closed, in token order.
+    // Complete once END_OF_FILE has been added.
+    const std::vector<uint32_t>& unbalanced() const { return strays; }
+    bool balanced() const { return strays.empty() && open.empty(); }
+    // Blocks still open after the tokens added so far, and the index of the innermost one.
+    size_t openCount() const { return open.size(); }
+    uint32_t innermost() const { return open.empty() ? NO_PARTNER : open.back().index; }
+
+    size_t memoryBytes() const {
+        return (partners.capacity() + depths.capacity() + strays.capacity()) * sizeof(uint32_t) + open.capacity() * sizeof(Open);
+    }
+
+    // One line with the totals, then one per unbalanced token.
+    template <typename Tokens>
+    std::string report(const Tokens& tokens) const {
+        std::string out = "Blocks: " + std::to_string(pairs) + " pairs, depth " + std::to_string(deepest) + ", ";
+        out += strays.empty() ? "balanced\n" : std::to_string(strays.size()) + " unbalanced\n";
+        for (uint32_t i : strays) {
+            TokenView token = tokens[i];
+            bool opener = token.type == TokenType::INTERPOLATION_BEGIN ||
+                          (token.type == TokenType::KEYWORD && token.keyword != Keyword::KEYWORD_END) ||
+                          token.lexeme == "(" || token.lexeme == "[" || token.lexeme == "{";
+            out += "  line " + std::to_string(token.line) + (opener ? ": unclosed " : ": unmatched ");
+            out.append(token.lexeme);
+            out += '\n';
+        }
+        return out;
+    }
+
+private:
+    enum Kind : uint8_t { BLOCK, PAREN, BRACKET, BRACE, INTERPOLATION };
+    enum Role : uint8_t {
+        NO_ROLE,
+        OPENS_BLOCK, OPENS_PAREN, OPENS_BRACKET, OPENS_BRACE, OPENS_INTERPOLATION,
+        CLOSES_BLOCK, CLOSES_PAREN, CLOSES_BRACKET, CLOSES_BRACE, CLOSES_INTERPOLATION
+    };
+
+    struct Open {
+        uint32_t index;
+        Kind kind;
+    };
+
+    std::string_view source;
+    std::vector<uint32_t> partners;
+    std::vector<uint32_t> depths;
+    std::vector<Open> open;
+    std::vector<uint32_t> strays;
+    uint32_t deepest = 0;
+    size_t pairs = 0;
+
+    // What the tokens before say about the next one.
+    const char* previousEnd = nullptr;
+    bool statementStart = true;   // it begins a statement, so `if` there opens a block
+    bool afterName = false;       // it follows '.', '&.', "::" or `def`, so a keyword there is a method name
+    bool loopHead = false;        // a `while`, `until` or `for` on this line takes the next `do` as its own
+    bool defHeader = false;       // the `def` on top of `open` has not reached its body yet
+
+    void endStatement() {
+        statementStart = true;
+        loopHead = false;
+        defHeader = false;
+    }
+
+    Role roleOf(const TokenView& token) {
+        switch (token.type) {
+            case TokenType::SEPARATOR:
+                switch (token.lexeme[0]) {
+                    case '(': return OPENS_PAREN;
+                    case '[': return OPENS_BRACKET;
+                    case '{': return OPENS_BRACE;
+                    case ')': return CLOSES_PAREN;
+                    case ']': return CLOSES_BRACKET;
+                    case '}': return CLOSES_BRACE;
+                    default: return NO_ROLE;
+                }
+            case TokenType::INTERPOLATION_BEGIN: return OPENS_INTERPOLATION;
+            case TokenType::INTERPOLATION_END: return CLOSES_INTERPOLATION;
+            case TokenType::KEYWORD: break;
+            default: return NO_ROLE;
+        }
+        if (afterName || isLabel(token)) return NO_ROLE;
+        switch (token.keyword) {
+            case Keyword::KEYWORD_CLASS: case Keyword::KEYWORD_MODULE: case Keyword::KEYWORD_DEF:
+            case Keyword::KEYWORD_CASE: case Keyword::KEYWORD_BEGIN: case Keyword::KEYWORD_FOR:
+                return OPENS_BLOCK;
+            case Keyword::KEYWORD_DO:
+                if (!loopHead) return OPENS_BLOCK;
+                loopHead = false;
+                return NO_ROLE;
+            case Keyword::KEYWORD_IF: case Keyword::KEYWORD_UNLESS:
+            case Keyword::KEYWORD_WHILE: case Keyword::KEYWORD_UNTIL:
+                return statementStart ? OPENS_BLOCK : NO_ROLE;
+            case Keyword::KEYWORD_END:
+                return CLOSES_BLOCK;
+            default:
+                return NO_ROLE;
+        }
+    }
+
+    // `if: cond` in an argument list is a hash key, not a keyword.
+    bool isLabel(const TokenView& token) const {
+        size_t after = token.lexeme.data() + token.lexeme.size() - source.data();
+        return after < source.size() && source[after] == ':' && (after + 1 >= source.size() || source[after + 1] != ':');
+    }
+
+    // Whether a keyword right after `token` begins a statement.
+    static bool startsStatement(const TokenView& token) {
+        switch (token.type) {
+            case TokenType::SEPARATOR: {
+                char c = token.lexeme[0];
+                return c == ';' || c == '(' || c == '[' || c == '{';
+            }
+            case TokenType::OPERATOR:
+                return token.op != Operator::OPERATOR_DOT && token.op != Operator::OPERATOR_SAFE_NAVIGATION &&
+                       token.op != Operator::OPERATOR_SCOPE;
+            case TokenType::COMMENT: case TokenType::INTERPOLATION_BEGIN:
+                return true;
+            case TokenType::KEYWORD:
+                switch (token.keyword) {
+                    case Keyword::KEYWORD_AND: case Keyword::KEYWORD_OR: case Keyword::KEYWORD_NOT:
+                    case Keyword::KEYWORD_THEN: case Keyword::KEYWORD_ELSE: case Keyword::KEYWORD_ELSIF:
+                    case Keyword::KEYWORD_DO: case Keyword::KEYWORD_BEGIN: case Keyword::KEYWORD_ENSURE:
+                    case Keyword::KEYWORD_IF: case Keyword::KEYWORD_UNLESS: case Keyword::KEYWORD_WHILE:
+                    case Keyword::KEYWORD_UNTIL: case Keyword::KEYWORD_CASE: case Keyword::KEYWORD_WHEN:
+                        return true;
+                    default:
+                        return false;
+                }
+            default:
+                return false;
+        }
+    }
+
+    void openBlock(uint32_t index, Kind kind, const TokenView& token) {
+        depths.push_back(static_cast<uint32_t>(open.size()));
+        open.push_back({index, kind});
+        deepest = std::max(deepest, static_cast<uint32_t>(open.size()));
+        Keyword keyword = kind == BLOCK ? token.keyword : Keyword::NOT_KEYWORD;
+        if (keyword == Keyword::KEYWORD_WHILE || keyword == Keyword::KEYWORD_UNTIL || keyword == Keyword::KEYWORD_FOR) loopHead = true;
+        if (keyword == Keyword::KEYWORD_DEF) defHeader = true;
+    }
+
+    // A closer matches the nearest open block of its kind. Anything opened after that one is
+    // left unclosed; with none open at all the closer itself is the stray.
+    void closeBlock(uint32_t index, Kind kind) {
+        size_t k = open.size();
+        while (k > 0 && open[k - 1].kind != kind) k--;
+        if (k == 0) {
+            depths.push_back(static_cast<uint32_t>(open.size()));
+            strays.push_back(index);
+            return;
+        }
+        for (; open.size() > k; open.pop_back()) strays.push_back(open.back().index);
+        uint32_t opener = open.back().index;
+        open.pop_back();
+        partners[opener] = index;
+        partners[index] = opener;
+        pairs++;
+        depths.push_back(static_cast<uint32_t>(open.size()));
+        if (kind == BLOCK) defHeader = false;
+    }
+
+    // `def name(args) = expr` has no `end`. Its '=' follows the parameter list or a space,
+    // where a setter's (`def name=(v)`, `def []=(k, v)`) is glued to the name.
+    void endlessDef(uint32_t index, const char* at) {
+        if (!defHeader || open.empty() || open.back().kind != BLOCK || at == source.data()) return;
+        char before = at[-1];
+        if (before != ')' && before != ' ' && before != '\t') return;
+        uint32_t def = open.back().index;
+        open.pop_back();
+        defHeader = false;
+        for (uint32_t i = def + 1; i <= index; i++) depths[i]--;
+    }
+};
+
+// Bump allocator for bytes that live until reset(). Chunks are kept across resets, so a
+// reset is O(1) and an arena that has warmed up stops calling the system allocator.
+class Arena {
+public:
+    explicit Arena(size_t chunkSize = 1 << 16) : chunkSize(std::max<size_t>(chunkSize, 1)) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    char* allocate(size_t size) {
+        if (size > left || !cursor) nextChunk(size);
+        char* out = cursor;
+        cursor += size;
+        left -= size;
+        return out;
+    }
+
+    std::string_view copy(std::string_view text) {
+        char* out = allocate(text.size());
+        std::memcpy(out, text.data(), text.size());
+        return std::string_view(out, text.size());
+    }
+
+    // Releases everything allocated so far; the memory is handed out again by later calls.
+    void reset() {
+        used = 0;
+        cursor = nullptr;
+        left = 0;
+    }
+
+    size_t reservedBytes() const {
+        size_t total = 0;
+        for (const Chunk& chunk : chunks) total += chunk.size;
+        return total;
+    }
+
+private:
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    size_t chunkSize;
+    std::vector<Chunk> chunks;
+    size_t used = 0;   // chunks handed out since the last reset; the cursor is in the last one
+    char* cursor = nullptr;
+    size_t left = 0;
+
+    // Moves to the next kept chunk that fits `size`, or adds one. A request larger than the
+    // chunk size gets a chunk of its own size.
+    void nextChunk(size_t size) {
+        while (used < chunks.size() && chunks[used].size < size) used++;
+        if (used == chunks.size()) {
+            size_t bytes = std::max(chunkSize, size);
+            chunks.push_back({std::unique_ptr<char[]>(new char[bytes]), bytes});
+        }
+        cursor = chunks[used].data.get();
+        left = chunks[used].size;
+        used++;
+    }
+};
+
+// Name tokens: the types whose lexemes TokenBuffer interns when it has an AtomTable.
+inline bool isNameToken(TokenType type) {
+    switch (type) {
+        case TokenType::IDENTIFIER_LOCAL: case TokenType::IDENTIFIER_INSTANCE: case TokenType::IDENTIFIER_CLASS:
+        case TokenType::IDENTIFIER_GLOBAL: case TokenType::CONSTANT: case TokenType::SYMBOL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Interns strings as 32-bit atoms: equal strings get equal atoms, so names compare as
+// integers and are stored once however often they occur. Shared by any number of threads.
+// The table is split into shards by hash, each with its own lock, open-addressed slot array,
+// entry list and Arena for the characters; an atom is the entry index followed by SHARD_BITS
+// of shard. Strings never move once interned, so name() views stay valid for the table's lifetime.
+class AtomTable {
+public:
+    static constexpr uint32_t NO_ATOM = UINT32_MAX;
+
+    AtomTable() = default;
+    AtomTable(const AtomTable&) = delete;
+    AtomTable& operator=(const AtomTable&) = delete;
+
+    uint32_t intern(std::string_view text) {
+        uint64_t hash = hashName(text);
+        uint32_t shardIndex = static_cast<uint32_t>(hash >> (64 - SHARD_BITS));
+        Shard& shard = shards[shardIndex];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        if ((shard.entries.size() + 1) * 2 > shard.slots.size()) shard.grow();
+        size_t mask = shard.slots.size() - 1;
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+            uint32_t index = shard.slots[slot];
+            if (index == EMPTY_SLOT) {
+                index = static_cast<uint32_t>(shard.entries.size());
+                shard.entries.push_back({hash, shard.arena.copy(text)});
+                shard.slots[slot] = index;
+                return index << SHARD_BITS | shardIndex;
+            }
+            const Entry& entry = shard.entries[index];
+            if (entry.hash == hash && entry.text == text) return index << SHARD_BITS | shardIndex;
+        }
+    }
+
+    std::string_view name(uint32_t atom) const {
+        const Shard& shard = shards[atom & (SHARD_COUNT - 1)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.entries[atom >> SHARD_BITS].text;
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (const Shard& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total += shard.entries.size();
+        }
+        return total;
+    }
+
+    // FNV-1a; stored with each entry so probing and growing never rehash the text.
+    static uint64_t hashName(std::string_view text) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (char c : text) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+private:
+    static constexpr int SHARD_BITS = 4;
+    static constexpr uint32_t SHARD_COUNT = 1u << SHARD_BITS;
+    static constexpr uint32_t EMPTY_SLOT = UINT32_MAX;
+    static constexpr size_t ARENA_CHUNK = 1 << 16;
+
+    struct Entry {
+        uint64_t hash;
+        std::string_view text;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::vector<uint32_t> slots;
+        std::deque<Entry> entries;
+        Arena arena{ARENA_CHUNK};
+
+        void grow() {
+            std::vector<uint32_t> bigger(std::max<size_t>(slots.size() * 2, 64), EMPTY_SLOT);
+            size_t mask = bigger.size() - 1;
+            for (uint32_t index = 0; index < entries.size(); index++) {
+                size_t slot = entries[index].hash & mask;
+                while (bigger[slot] != EMPTY_SLOT) slot = (slot + 1) & mask;
+                bigger[slot] = index;
+            }
+            slots.swap(bigger);
+        }
+    };
+
+    std::array<Shard, SHARD_COUNT> shards;
+};
+
+// Rough token count for sizing a TokenBuffer: word starts and punctuation bytes in a sample
+// from the front of the source, scaled to its full length. Comments and quotes count once
+// and are skipped to the end of the line or quote. Operators like "+=" count twice, so the
+// estimate errs high, the cheaper way to be wrong.
+inline size_t estimateTokenCount(std::string_view source) {
+    constexpr size_t SAMPLE_BYTES = 1 << 16;
+    size_t sample = std::min(source.size(), SAMPLE_BYTES);
+    size_t starts = 0;
+    bool inWord = false;
+    for (size_t i = 0; i < sample; i++) {
+        char c = source[i];
+        bool word = isIdentifierByte(c);
+        if (c == '#' || c == '"' || c == '\'') {
+            char close = c == '#' ? '\n' : c;
+            while (i + 1 < sample && source[i + 1] != close && source[i + 1] != '\n') i++;
+            if (c != '#') i++;
+        }
+        starts += (word && !inWord) || (!word && !isSpaceByte(c) && static_cast<unsigned char>(c) < 0x80);
+        inWord = word;
+    }
+    if (sample == 0) return 1;
+    return static_cast<size_t>(static_cast<double>(starts) * source.size() / sample) + 1;
+}
+
+// Tokens of one source stored column by column: a type byte, a tokenDetail() byte and the
+// lexeme as an offset and length into the source, about 10 bytes a token against 40 for a
+// TokenView. The values the lexer decoded for number tokens sit in a side table of their
+// own, 12 bytes per number token. Lines come from a LineIndex built once per source; nothing
+// is lexed again when a view is made. Given an AtomTable, the buffer also interns the lexeme
+// of every name token into an atom column. The source must outlive the buffer.
+class TokenBuffer {
+public:
+    explicit TokenBuffer(AtomTable* atoms = nullptr) : atomTable(atoms) {}
+
+    // Clears the buffer for a new source and sizes it from estimateTokenCount(). Inputs under
+    // SMALL_INPUT bytes reserve room for a token at every byte instead, which costs little,
+    // skips the estimate, and lets a reused buffer take any later small input as it is.
+    void reset(std::string_view newSource) {
+        source = newSource;
+        clear();
+        lineIndex.build(newSource);
+        if (newSource.size() < SMALL_INPUT) reserve(SMALL_INPUT + 1);
+        else reserve(estimateTokenCount(newSource));
+    }
+
+    static constexpr size_t SMALL_INPUT = 1 << 12;
+
+    void clear() {
+        typeColumn.clear();
+        detailColumn.clear();
+        numberTokens.clear();
+        numberValues.clear();
+        offsetColumn.clear();
+        lengthColumn.clear();
+        atomColumn.clear();
+    }
+
+    void reserve(size_t count) {
+        typeColumn.reserve(count);
+        detailColumn.reserve(count);
+        offsetColumn.reserve(count);
+        lengthColumn.reserve(count);
+        if (atomTable) atomColumn.reserve(count);
+    }
+
+    // Takes a token whose lexeme points into the source; END_OF_FILE is stored at its end.
+    // The token's line is not kept: views look it up from the offset.
+    void push_back(const TokenView& token) {
+        size_t offset = token.type == TokenType::END_OF_FILE ? source.size() : token.lexeme.data() - source.data();
+        if (isNumberType(token.type)) {
+            numberTokens.push_back(static_cast<uint32_t>(typeColumn.size()));
+            numberValues.push_back(token.number);
+        }
+        typeColumn.push_back(static_cast<uint8_t>(token.type));
+        detailColumn.push_back(tokenDetail(token));
+        offsetColumn.push_back(static_cast<uint32_t>(offset));
+        lengthColumn.push_back(static_cast<uint32_t>(token.lexeme.size()));
+        if (atomTable) atomColumn.push_back(isNameToken(token.type) ? atomTable->intern(token.lexeme) : AtomTable::NO_ATOM);
+    }
+
+    size_t size() const { return typeColumn.size(); }
+    bool empty() const { return typeColumn.empty(); }
+    size_t capacity() const { return typeColumn.capacity(); }
+
+    TokenType type(size_t i) const { return static_cast<TokenType>(typeColumn[i]); }
+    std::string_view lexeme(size_t i) const { return source.substr(offsetColumn[i], lengthColumn[i]); }
+    // NO_ATOM for tokens that are not names, and for every token when there is no AtomTable.
+    uint32_t atom(size_t i) const { return atomColumn.empty() ? AtomTable::NO_ATOM : atomColumn[i]; }
+    AtomTable* atoms() const { return atomTable; }
+
+    TokenView operator[](size_t i) const {
+        size_t slot = std::lower_bound(numberTokens.begin(), numberTokens.end(), i) - numberTokens.begin();
+        return view(i, lineIndex.line(offsetColumn[i]), slot);
+    }
+
+    // Line and UTF-8 column where token `i` starts.
+    LineIndex::Location location(size_t i) const { return lineIndex.location(offsetColumn[i]); }
+    const LineIndex& lines() const { return lineIndex; }
+
+    // Whole columns, for scans that need only one field.
+    const std::vector<uint8_t>& types() const { return typeColumn; }
+    const std::vector<uint32_t>& offsets() const { return offsetColumn; }
+
+    size_t memoryBytes() const {
+        return typeColumn.capacity() + detailColumn.capacity() +
+               (offsetColumn.capacity() + lengthColumn.capacity() + atomColumn.capacity() + numberTokens.capacity()) * sizeof(uint32_t) +
+               numberValues.capacity() * sizeof(NumberValue) + lineIndex.memoryBytes();
+    }
+
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = TokenView;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = TokenView;
+
+        iterator(const TokenBuffer* buffer, size_t index) : buffer(buffer), index(index), lineCursor(buffer->lineIndex) {}
+
+        // Walking forward, the line lookup only steps past the newlines between tokens and the
+        // number slot past the number tokens.
+        TokenView operator*() const {
+            while (numberSlot < buffer->numberTokens.size() && buffer->numberTokens[numberSlot] < index) numberSlot++;
+            return buffer->view(index, lineCursor.line(buffer->offsetColumn[index]), numberSlot);
+        }
+        iterator& operator++() { index++; return *this; }
+        iterator operator++(int) { iterator old = *this; index++; return old; }
+        bool operator==(const iterator& other) const { return index == other.index; }
+        bool operator!=(const iterator& other) const { return index != other.index; }
+
+    private:
+        const TokenBuffer* buffer;
+        size_t index;
+        mutable LineIndex::Cursor lineCursor;
+        mutable size_t numberSlot = 0;
+    };
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, size()); }
+
+private:
+    std::string_view source;
+    std::vector<uint8_t> typeColumn;
+    std::vector<uint8_t> detailColumn;
+    std::vector<uint32_t> numberTokens;      // index of every number token, ascending
+    std::vector<NumberValue> numberValues;   // and its value
+    std::vector<uint32_t> offsetColumn;
+    std::vector<uint32_t> lengthColumn;
+    std::vector<uint32_t> atomColumn;
+    AtomTable* atomTable = nullptr;
+    LineIndex lineIndex;
+
+    // `slot` is token i's place in the number columns; it is only read for a number token.
+    TokenView view(size_t i, int line, size_t slot) const {
+        TokenView token{type(i), lexeme(i), line};
+        uint8_t detail = detailColumn[i];
+        if (token.type == TokenType::KEYWORD) token.keyword = static_cast<Keyword>(detail);
+        else if (token.type == TokenType::OPERATOR) token.op = static_cast<Operator>(detail);
+        else if (isNumberType(token.type)) {
+            token.number = numberValues[slot];
+            token.bigInteger = detail != 0;
+        }
+        return token;
+    }
+};
+
+
+// Lexes one input after another without giving memory back: each input is copied into an
+// Arena and its tokens go into a TokenBuffer, and the next call reuses both. Meant for
+// services that lex many small snippets, where fresh storage per call costs more than the
+// lexing itself. `Engine` is constructed over the input and lexes it with analyzeInto();
+// each lexer names its own as LexerSession.
+template <typename Engine>
+class BasicLexerSession {
+public:
+    explicit BasicLexerSession(AtomTable* atoms = nullptr) : tokenBuffer(atoms) {}
+
+    // Drops the previous input and its tokens in O(1) and takes a copy of `input`.
+    void reset(std::string_view input) {
+        arena.reset();
+        text = arena.copy(input);
+    }
+
+    // Lexes the current input. Tokens and lexemes stay valid until the next reset().
+    const TokenBuffer& analyze() {
+        Engine(text).analyzeInto(tokenBuffer);
+        return tokenBuffer;
+    }
+
+    const TokenBuffer& analyze(std::string_view input) {
+        reset(input);
+        return analyze();
+    }
+
+    std::string_view source() const { return text; }
+    const TokenBuffer& tokens() const { return tokenBuffer; }
+
+    // For callers' own per-input allocations; released by the next reset() like the input.
+    Arena& scratch() { return arena; }
+
+private:
+    Arena arena;
+    std::string_view text;
+    TokenBuffer tokenBuffer;
+};
+
+
+// Pull-based lexing of a file descriptor or std::istream read in fixed-size blocks. Only the
+// unread part of the current block and the token being scanned are kept in memory, so usage
+// is bounded by the block size plus the longest token, whatever the input size. `Scanner`
+// is how an engine lexes one step: modes() gives its LexModes, and
+// scan(buffer, pos, end, token) lexes from `pos`, sets `end` to where it stopped and returns
+// whether it produced `token`. Each lexer names its stream TokenStream.
+template <typename Scanner>
+class BasicTokenStream {
+public:
+    static constexpr size_t DEFAULT_BLOCK_SIZE = 1 << 16;
+
+    explicit BasicTokenStream(int fd, size_t blockSize = DEFAULT_BLOCK_SIZE) : fd(fd), blockSize(std::max<size_t>(blockSize, 1)) {}
+    explicit BasicTokenStream(std::istream& in, size_t blockSize = DEFAULT_BLOCK_SIZE) : in(&in), blockSize(std::max<size_t>(blockSize, 1)) {}
+
+    // Produces the next token; the last one is END_OF_FILE, after which next() returns false.
+    // The lexeme points into the stream's buffer and is only valid until the following call.
+    bool next(TokenView& token) {
+        if (finished) return false;
+        while (true) {
+            if (pos >= buffer.size() && !fill(blockSize)) {
+                token = {TokenType::END_OF_FILE, "", line};
+                finished = true;
+                return true;
+            }
+
+            LexModes before = scanner.modes();
+            scanner.modes().reach = 0;
+            size_t end = pos;
+            bool produced = scanner.scan(buffer, pos, end, token);
+
+            // The scan looks at most one byte past where it stops, or up to `reach` when it
+            // looked for a heredoc terminator. If that lies beyond the buffer the token may
+            // continue in unread input: read more and scan it again from the same mode,
+            // asking for at least as much as is buffered so a huge token costs O(n) overall.
+            size_t looked = std::max<size_t>(end + 1, scanner.modes().reach);
+            if (looked >= buffer.size() && !inputDone) {
+                scanner.modes() = std::move(before);
+                fill(std::max(blockSize, buffer.size() - pos));
+                continue;
+            }
+            // Lines come from the newlines each step consumed; a token is on the line it starts on.
+            if (produced) token.line = line + static_cast<int>(std::count<const char*>(buffer.data() + pos, token.lexeme.data(), '\n'));
+            line += std::count(buffer.begin() + pos, buffer.begin() + end, '\n');
+            pos = end;
+            if (produced) return true;
+        }
+    }
+
+    bool failed() const { return readError; }
+
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = TokenView;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const TokenView*;
+        using reference = const TokenView&;
+
+        iterator() = default;
+        explicit iterator(BasicTokenStream* stream) : stream(stream) { ++*this; }
+
+        reference operator*() const { return token; }
+        pointer operator->() const { return &token; }
+        iterator& operator++() {
+            if (stream && !stream->next(token)) stream = nullptr;
+            return *this;
+        }
+        bool operator==(const iterator& other) const { return stream == other.stream; }
+        bool operator!=(const iterator& other) const { return stream != other.stream; }
+
+    private:
+        BasicTokenStream* stream = nullptr;
+        TokenView token{TokenType::END_OF_FILE, "", 0};
+    };
+
+    iterator begin() { return iterator(this); }
+    iterator end() { return iterator(); }
+
+private:
+    int fd = -1;
+    std::istream* in = nullptr;
+    size_t blockSize;
+
+    std::string buffer;
+    size_t pos = 0;
+    int line = 1;
+    bool inputDone = false;
+    bool finished = false;
+    bool readError = false;
+
+    Scanner scanner;
+
+    // Drops the bytes already lexed but the last, which heredoc openers look back at, and
+    // appends up to `want` more. Returns false once the input is exhausted.
+    bool fill(size_t want) {
+        if (inputDone) return false;
+        size_t keep = std::min<size_t>(pos, 1);
+        buffer.erase(0, pos - keep);
+        pos = keep;
+        size_t old = buffer.size();
+        buffer.resize(old + want);
+        size_t got = 0;
+        if (in) {
+            in->read(&buffer[old], want);
+            got = in->gcount();
+            if (in->bad()) readError = true;
+        } else {
+            ssize_t n;
+            while ((n = read(fd, &buffer[old], want)) < 0 && errno == EINTR) {}
+            if (n < 0) readError = true;
+            got = n > 0 ? n : 0;
+        }
+        buffer.resize(old + got);
+        if (got == 0) inputDone = true;
+        return got > 0;
+    }
+};
+
+
+enum class StatsFormat {
+    NONE,
+    JSON,
+    PROMETHEUS   // Prometheus text exposition format
+};
+
+inline bool parseStatsFormat(std::string_view name, StatsFormat& format) {
+    if (name == "json") format = StatsFormat::JSON;
+    else if (name == "prometheus") format = StatsFormat::PROMETHEUS;
+    else return false;
+    return true;
+}
+
+// Cheap monotonic tick source for sampled timings: the timestamp counter on x86, steady_clock
+// nanoseconds elsewhere.
+inline uint64_t readTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+constexpr size_t TOKEN_TYPE_COUNT = std::size(tokenTypeNames);
+
+// Per-state and per-edge counters of a table-driven engine. States and edge targets are
+// numbered as in the engine's transition trace and named by `name`.
+struct TransitionCounts {
+    static constexpr size_t MAX_STATES = 32;
+
+    std::string_view (*name)(uint8_t);
+    std::array<uint64_t, MAX_STATES> stateVisits{};
+    std::vector<uint64_t> edges = std::vector<uint64_t>(MAX_STATES * 256);   // [from][to]
+};
+
+// Counters for one or more lexing runs: per token type, the count, bytes, a histogram of
+// lexeme lengths in powers of two, and the ticks spent on every SAMPLE_EVERY-th token; and,
+// for an engine that reports them, how many bytes each state consumed and how often each
+// transition edge was taken. Each run fills a LexerStats of its own; merge() adds them up
+// afterwards, so threads never share one while lexing.
+struct LexerStats {
+    static constexpr int LENGTH_BUCKETS = 17;   // bucket k holds lengths below 2^k; the last one the rest
+    static constexpr uint64_t SAMPLE_EVERY = 64;
+
+    struct PerType {
+        uint64_t count = 0;
+        uint64_t bytes = 0;
+        std::array<uint64_t, LENGTH_BUCKETS> lengths{};
+        uint64_t samples = 0;
+        uint64_t sampleTicks = 0;
+    };
+
+    std::array<PerType, TOKEN_TYPE_COUNT> types{};
+    std::optional<TransitionCounts> transitions;   // set by countTransitions()
+
+    // Starts per-state and per-edge counting, with states named by `name`.
+    void countTransitions(std::string_view (*name)(uint8_t)) {
+        if (!transitions) transitions.emplace(TransitionCounts{name});
+    }
+
+    // Only after countTransitions().
+    void recordTransition(uint8_t from, uint8_t to) {
+        transitions->stateVisits[from]++;
+        transitions->edges[from * 256 + to]++;
+    }
+
+    // A sampled token's time runs from the end of the token before it, so it includes the
+    // whitespace in between.
+    void recordToken(TokenType type, size_t length) {
+        PerType& stats = types[static_cast<size_t>(type)];
+        stats.count++;
+        stats.bytes += length;
+        stats.lengths[std::min<size_t>(bitWidth(length), LENGTH_BUCKETS - 1)]++;
+        if (sampleStart) {
+            stats.samples++;
+            stats.sampleTicks += readTicks() - sampleStart;
+            sampleStart = 0;
+        }
+        if (++seen % SAMPLE_EVERY == 0) sampleStart = readTicks();
+    }
+
+    void merge(const LexerStats& other) {
+        for (size_t t = 0; t < TOKEN_TYPE_COUNT; t++) {
+            types[t].count += other.types[t].count;
+            types[t].bytes += other.types[t].bytes;
+            for (int b = 0; b < LENGTH_BUCKETS; b++) types[t].lengths[b] += other.types[t].lengths[b];
+            types[t].samples += other.types[t].samples;
+            types[t].sampleTicks += other.types[t].sampleTicks;
+        }
+        if (other.transitions) {
+            countTransitions(other.transitions->name);
+            for (size_t s = 0; s < TransitionCounts::MAX_STATES; s++) transitions->stateVisits[s] += other.transitions->stateVisits[s];
+            for (size_t e = 0; e < transitions->edges.size(); e++) transitions->edges[e] += other.transitions->edges[e];
+        }
+    }
+
+    std::string report(StatsFormat format, std::string_view engine) const {
+        std::ostringstream out;
+        if (format == StatsFormat::JSON) {
+            out << "{\"engine\":\"" << engine << "\",\"tokens\":{";
+            bool first = true;
+            for (size_t t = 0; t < TOKEN_TYPE_COUNT; t++) {
+                const PerType& stats = types[t];
+                if (!stats.count) continue;
+                out << (first ? "" : ",") << "\"" << tokenTypeNames[t] << "\":{\"count\":" << stats.count
+                    << ",\"bytes\":" << stats.bytes << ",\"length_buckets\":[";
+                for (int b = 0; b < LENGTH_BUCKETS; b++) out << (b ? "," : "") << stats.lengths[b];
+                out << "],\"samples\":" << stats.samples << ",\"sample_ticks\":" << stats.sampleTicks << "}";
+                first = false;
+            }
+            out << "}";
+            if (transitions) {
+                out << ",\"states\":{";
+                first = true;
+                for (size_t s = 0; s < TransitionCounts::MAX_STATES; s++) {
+                    if (!transitions->stateVisits[s]) continue;
+                    out << (first ? "" : ",") << "\"" << transitions->name(s) << "\":" << transitions->stateVisits[s];
+                    first = false;
+                }
+                out << "},\"transitions\":[";
+                first = true;
+                for (size_t e = 0; e < transitions->edges.size(); e++) {
+                    if (!transitions->edges[e]) continue;
+                    out << (first ? "" : ",") << "{\"from\":\"" << transitions->name(e / 256)
+                        << "\",\"to\":\"" << transitions->name(e % 256) << "\",\"count\":" << transitions->edges[e] << "}";
+                    first = false;
+                }
+                out << "]";
+            }
+            out << "}\n";
+        } else if (format == StatsFormat::PROMETHEUS) {
+            auto labels = [&](size_t t) { return "{engine=\"" + std::string(engine) + "\",type=\"" + std::string(tokenTypeNames[t]) + "\""; };
+            out << "# TYPE lexer_tokens_total counter\n";
+            for (size_t t = 0; t < TOKEN_TYPE_COUNT; t++) {
+                if (types[t].count) out << "lexer_tokens_total" << labels(t) << "} " << types[t].count << "\n";
+            }
+            out << "# TYPE lexer_token_bytes_total counter\n";
+            for (size_t t = 0; t < TOKEN_TYPE_COUNT; t++) {
+                if (types[t].count) out << "lexer_token_bytes_total" << labels(t) << "} " << types[t].bytes << "\n";
+            }
+            out << "# TYPE lexer_lexeme_length histogram\n";
+            for (size_t t = 0; t < TOKEN_TYPE_COUNT; t++) {
+                if (!types[t].count) continue;
+                uint64_t cumulative = 0;
+                for (int b = 0; b < LENGTH_BUCKETS - 1; b++) {
+                    cumulative += types[t].lengths[b];
+                    out << "lexer_lexeme_length_bucket" << labels(t) << ",le=\"" << ((uint64_t(1) << b) - 1) << "\"} " << cumulative << "\n";
+                }
+                out << "lexer_lexeme_length_bucket" << labels(t) << ",le=\"+Inf\"} " << types[t].count << "\n";
+                out << "lexer_lexeme_length_sum" << labels(t) << "} " << types[t].bytes << "\n";
+                out << "lexer_lexeme_length_count" << labels(t) << "} " << types[t].count << "\n";
+            }
+            out << "# TYPE lexer_sampled_tokens_total counter\n";
+            for (size_t t = 0; t < TOKEN_TYPE_COUNT; t++) {
+                if (types[t].samples) out << "lexer_sampled_tokens_total" << labels(t) << "} " << types[t].samples << "\n";
+            }
+            out << "# TYPE lexer_sampled_ticks_total counter\n";
+            for (size_t t = 0; t < TOKEN_TYPE_COUNT; t++) {
+                if (types[t].samples) out << "lexer_sampled_ticks_total" << labels(t) << "} " << types[t].sampleTicks << "\n";
+            }
+            if (transitions) {
+                out << "# TYPE lexer_state_visits_total counter\n";
+                for (size_t s = 0; s < TransitionCounts::MAX_STATES; s++) {
+                    if (transitions->stateVisits[s]) {
+                        out << "lexer_state_visits_total{engine=\"" << engine << "\",state=\"" << transitions->name(s)
+                            << "\"} " << transitions->stateVisits[s] << "\n";
+                    }
+                }
+                out << "# TYPE lexer_transitions_total counter\n";
+                for (size_t e = 0; e < transitions->edges.size(); e++) {
+                    if (transitions->edges[e]) {
+                        out << "lexer_transitions_total{engine=\"" << engine << "\",from=\"" << transitions->name(e / 256)
+                            << "\",to=\"" << transitions->name(e % 256) << "\"} " << transitions->edges[e] << "\n";
+                    }
+                }
+            }
+        }
+        return out.str();
+    }
+
+private:
+    uint64_t seen = 0;
+    uint64_t sampleStart = 0;
+
+    static size_t bitWidth(size_t value) {
+        size_t width = 0;
+        for (; value; value >>= 1) width++;
+        return width;
+    }
+};
+
+// Read-only view of a file's bytes. Regular files are memory-mapped; anything mmap
+// refuses (pipes, empty files) is read into an owned buffer instead.
+class SourceFile {
+public:
+    SourceFile() = default;
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    ~SourceFile() { close(); }
+
+    bool open(const std::string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+                ::close(fd);
+                data = static_cast<const char*>(mapped);
+                size = st.st_size;
+                isMapped = true;
+                return true;
+            }
+        }
+
+        char chunk[1 << 16];
+        ssize_t n;
+        while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+            owned.append(chunk, n);
+        }
+        ::close(fd);
+        if (n < 0) return false;
+        data = owned.data();
+        size = owned.size();
+        return true;
+    }
+
+    std::string_view view() const { return {data, size}; }
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+    bool isMapped = false;
+    std::string owned;
+
+    void close() {
+        if (isMapped) munmap(const_cast<char*>(data), size);
+        owned.clear();
+        data = nullptr;
+        size = 0;
+        isMapped = false;
+    }
+};
+
+enum class OutputFormat {
+    HUMAN,  // "Line N:\t< lexeme >\t -> TYPE"
+    TSV     // line, type and lexeme columns under a header row; tabs, newlines and backslashes escaped
+};
+
+inline bool parseOutputFormat(std::string_view name, OutputFormat& format) {
+    if (name == "human") format = OutputFormat::HUMAN;
+    else if (name == "tsv") format = OutputFormat::TSV;
+    else return false;
+    return true;
+}
+
+// Formats tokens into one reusable buffer and hands it to write(2) a chunk at a time,
+// instead of going through iostreams and flushing per token. With fd < 0 nothing is
+// written and take() returns the formatted text.
+class TokenWriter {
+public:
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+    explicit TokenWriter(int fd, OutputFormat format = OutputFormat::HUMAN) : fd(fd), format(format) {
+        buffer.reserve(CHUNK_SIZE + 4096);
+        if (format == OutputFormat::TSV) buffer.append("line\ttype\tlexeme\n");
+    }
+    TokenWriter(const TokenWriter&) = delete;
+    TokenWriter& operator=(const TokenWriter&) = delete;
+    ~TokenWriter() { flush(); }
+
+    void write(const TokenView& token) {
+        if (format == OutputFormat::TSV) {
+            appendNumber(token.line);
+            buffer += '\t';
+            buffer.append(tokenTypeToString(token.type));
+            buffer += '\t';
+            appendEscaped(token.lexeme);
+            buffer += '\n';
+        } else {
+            buffer.append("Line ");
+            appendNumber(token.line);
+            buffer.append(":\t< ");
+            buffer.append(token.lexeme);
+            buffer.append(" >\t -> ");
+            buffer.append(tokenTypeToString(token.type));
+            buffer += '\n';
+        }
+        if (buffer.size() >= CHUNK_SIZE) flush();
+    }
+
+    void writeTransition(std::string_view from, char character, std::string_view to) {
+        buffer.append("    ");
+        buffer.append(from);
+        buffer.append(" --'");
+        buffer += character;
+        buffer.append("'--> ");
+        buffer.append(to);
+        buffer += '\n';
+        if (buffer.size() >= CHUNK_SIZE) flush();
+    }
+
+    void writeRaw(std::string_view text) {
+        buffer.append(text);
+        if (buffer.size() >= CHUNK_SIZE) flush();
+    }
+
+    // Returns false if the descriptor refused part of the output.
+    bool flush() {
+        if (fd < 0 || buffer.empty()) return !writeFailed;
+        const char* p = buffer.data();
+        size_t left = buffer.size();
+        while (left > 0) {
+            ssize_t n = ::write(fd, p, left);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                writeFailed = true;
+                break;
+            }
+            p += n;
+            left -= n;
+        }
+        buffer.clear();
+        return !writeFailed;
+    }
+
+    std::string take() {
+        std::string text = std::move(buffer);
+        buffer.clear();
+        return text;
+    }
+
+private:
+    int fd;
+    OutputFormat format;
+    std::string buffer;
+    bool writeFailed = false;
+
+    void appendNumber(long long value) {
+        char digits[24];
+        auto [end, error] = std::to_chars(digits, digits + sizeof(digits), value);
+        buffer.append(digits, end);
+    }
+
+    void appendEscaped(std::string_view text) {
+        size_t from = 0;
+        for (size_t i = 0; i < text.size(); i++) {
+            const char* escape = nullptr;
+            switch (text[i]) {
+                case '\t': escape = "\\t"; break;
+                case '\n': escape = "\\n"; break;
+                case '\r': escape = "\\r"; break;
+                case '\\': escape = "\\\\"; break;
+                default: continue;
+            }
+            buffer.append(text.substr(from, i - from));
+            buffer.append(escape);
+            from = i + 1;
+        }
+        buffer.append(text.substr(from));
+    }
+};
+
+inline void printTokens(const TokenBuffer& tokens, TokenWriter& writer) {
+    for (const TokenView& token : tokens) {
+        writer.write(token);
+    }
+}
+
+
+// Runs a fixed set of independent tasks on a group of threads. Task indices are dealt
+// round-robin into one deque per worker, so submitting the heaviest tasks first starts them
+// first. A worker takes from the front of its own deque and, once that is empty, steals
+// from the back of the others'.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned threads) : queues(std::max(1u, threads)) {}
+
+    void run(size_t taskCount, const std::function<void(size_t)>& task) {
+        for (size_t i = 0; i < taskCount; i++) {
+            queues[i % queues.size()].tasks.push_back(i);
+        }
+        std::vector<std::thread> workers;
+        for (size_t w = 0; w < queues.size(); w++) {
+            workers.emplace_back([this, w, &task] {
+                size_t next;
+                while (takeOwn(w, next) || steal(w, next)) task(next);
+            });
+        }
+        for (auto& worker : workers) worker.join();
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+    std::vector<Queue> queues;
+
+    bool takeOwn(size_t w, size_t& task) {
+        std::lock_guard<std::mutex> lock(queues[w].mutex);
+        if (queues[w].tasks.empty()) return false;
+        task = queues[w].tasks.front();
+        queues[w].tasks.pop_front();
+        return true;
+    }
+
+    bool steal(size_t thief, size_t& task) {
+        for (size_t offset = 1; offset < queues.size(); offset++) {
+            Queue& victim = queues[(thief + offset) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.tasks.empty()) continue;
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+        return false;
+    }
+};
+
+// Expands batch arguments into a sorted list of files: directories are walked for *.rb
+// files, anything else is taken as a file path. Unreadable directories are reported and
+// skipped.
+inline std::vector<std::string> collectBatchInputs(const std::vector<std::string>& args) {
+    std::vector<std::string> paths;
+    for (const auto& arg : args) {
+        std::error_code error;
+        if (std::filesystem::is_directory(arg, error)) {
+            std::filesystem::recursive_directory_iterator it(arg, std::filesystem::directory_options::skip_permission_denied, error), end;
+            for (; !error && it != end; it.increment(error)) {
+                if (it->path().extension() == ".rb" && it->is_regular_file(error)) paths.push_back(it->path().string());
+            }
+            if (error) std::cerr << "Error: Unable to walk " << arg << ": " << error.message() << std::endl;
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+    return paths;
+}
+
+// Reads one path per line from `listPath` ("-" for standard input).
+inline std::vector<std::string> readPathList(const std::string& listPath) {
+    std::vector<std::string> paths;
+    std::ifstream file;
+    std::istream& in = listPath == "-" ? std::cin : (file.open(listPath), file);
+    std::string path;
+    while (std::getline(in, path)) {
+        if (!path.empty()) paths.push_back(path);
+    }
+    return paths;
+}
+
+// Indexes into `paths`, largest file first, so one big file does not finish alone at the end
+// of a run. Files whose size cannot be read go last, in path order.
+inline std::vector<size_t> largestFirst(const std::vector<std::string>& paths) {
+    std::vector<uintmax_t> sizes(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+        std::error_code error;
+        sizes[i] = std::filesystem::file_size(paths[i], error);
+        if (error) sizes[i] = 0;
+    }
+    std::vector<size_t> order(paths.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+    return order;
+}
+
+// Runs `work(i)`, returning a Result, for every path on `threads` workers in largestFirst()
+// order, and hands the results to `emit` in path order: each one as soon as it and everything
+// before it are done. `emit` runs under the lock that orders the output, so whatever it adds
+// up needs no locking of its own.
+template <typename Result, typename Work, typename Emit>
+void runInPathOrder(const std::vector<std::string>& paths, unsigned threads, Work work, Emit emit) {
+    std::vector<size_t> order = largestFirst(paths);
+    std::vector<Result> results(paths.size());
+    std::vector<char> finished(paths.size(), 0);
+    std::mutex emitMutex;
+    size_t nextToEmit = 0;
+
+    WorkStealingPool pool(threads);
+    pool.run(order.size(), [&](size_t slot) {
+        size_t i = order[slot];
+        Result result = work(i);
+
+        std::lock_guard<std::mutex> lock(emitMutex);
+        results[i] = std::move(result);
+        finished[i] = 1;
+        for (; nextToEmit < paths.size() && finished[nextToEmit]; nextToEmit++) {
+            emit(results[nextToEmit]);
+            results[nextToEmit] = Result();
+        }
+    });
+}
+
+struct BatchOptions {
+    bool listTokens = false;
+    OutputFormat format = OutputFormat::HUMAN;
+    AtomTable* atoms = nullptr;          // shared by all files when interning
+    StatsFormat stats = StatsFormat::NONE;
+};
+
+// One file's part of a batch run. `extra` is whatever the engine collects per file besides
+// tokens and stats.
+template <typename Extra>
+struct BatchResult {
+    std::string output;
+    bool failed = false;
+    size_t bytes = 0;
+    size_t tokens = 0;
+    std::unique_ptr<LexerStats> stats;   // this file's counters, when collecting them
+    Extra extra{};
+};
+
+// How a batch run lexes with one engine:
+//   Extra                          per-file result besides tokens and stats
+//   name()                         the engine label in the stats report
+//   lex(source, tokens, stats)     lexes into a TokenBuffer, counting into `stats` if set
+//   inspect(path, source, tokens, extra)   collects `extra` from the tokens
+//   merge(extra)                   takes in one file's `extra`, in path order
+template <typename Engine>
+BatchResult<typename Engine::Extra> lexBatchFile(const std::string& path, const BatchOptions& options, const Engine& engine) {
+    BatchResult<typename Engine::Extra> result;
+    SourceFile file;
+    if (!file.open(path)) {
+        result.failed = true;
+        result.output = "Error: Unable to open " + path + "\n";
+        return result;
+    }
+    TokenBuffer tokens(options.atoms);
+    if (options.stats != StatsFormat::NONE) result.stats = std::make_unique<LexerStats>();
+    engine.lex(file.view(), tokens, result.stats.get());
+    size_t unknown = std::count(tokens.types().begin(), tokens.types().end(), static_cast<uint8_t>(TokenType::UNKNOWN));
+    engine.inspect(path, file.view(), tokens, result.extra);
+
+    std::ostringstream out;
+    out << path << ": " << tokens.size() << " tokens, " << unknown << " unknown" << std::endl;
+    if (options.listTokens) {
+        TokenWriter writer(-1, options.format);
+        printTokens(tokens, writer);
+        out << writer.take();
+    }
+    result.output = out.str();
+    result.bytes = file.view().size();
+    result.tokens = tokens.size();
+    return result;
+}
+
+// Lexes every file with runInPathOrder(), printing each file's line (and tokens, with
+// listTokens) and a summary. Per-file stats and extras are merged as they are emitted.
+template <typename Engine>
+int runBatch(const std::vector<std::string>& paths, unsigned threads, const BatchOptions& options, Engine& engine) {
+    auto started = std::chrono::steady_clock::now();
+    size_t failures = 0, bytes = 0, tokens = 0;
+    LexerStats totalStats;
+
+    using Result = BatchResult<typename Engine::Extra>;
+    runInPathOrder<Result>(paths, threads, [&](size_t i) { return lexBatchFile(paths[i], options, engine); },
+                           [&](Result& ready) {
+        (ready.failed ? std::cerr : std::cout) << ready.output;
+        failures += ready.failed;
+        bytes += ready.bytes;
+        tokens += ready.tokens;
+        if (ready.stats) totalStats.merge(*ready.stats);
+        engine.merge(ready.extra);
+    });
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    std::cout << "Lexed " << paths.size() - failures << " files (" << bytes << " bytes, " << tokens << " tokens";
+    if (options.atoms) std::cout << ", " << options.atoms->size() << " distinct names";
+    std::cout << ") in " << elapsed.count() << " ms on " << std::max(1u, threads) << " threads";
+    if (failures) std::cout << ", " << failures << " failed";
+    std::cout << std::endl;
+    if (options.stats != StatsFormat::NONE) std::cerr << totalStats.report(options.stats, engine.name());
+    return failures ? 1 : 0;
+}
+
+// Lexes `path` ("-" for standard input) through a `Stream`, one of the lexers' TokenStream
+// types, printing tokens as they come.
+template <typename Stream>
+bool streamTokens(const std::string& path, size_t blockSize, OutputFormat format) {
+    int fd = path == "-" ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error: Unable to open " << path << std::endl;
+        return false;
+    }
+    Stream tokens(fd, blockSize);
+    TokenWriter writer(STDOUT_FILENO, format);
+    for (const TokenView& token : tokens) {
+        writer.write(token);
+    }
+    if (fd != STDIN_FILENO) ::close(fd);
+    if (tokens.failed()) {
+        std::cerr << "Error: Unable to read " << path << std::endl;
+        return false;
+    }
+    if (!writer.flush()) {
+        std::cerr << "Error: Unable to write output" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Checks that every name token in `tokens` carries the atom of its lexeme and no other
+// token has one.
+inline bool verifyAtoms(const TokenBuffer& tokens) {
+    for (size_t i = 0; i < tokens.size(); i++) {
+        uint32_t atom = tokens.atom(i);
+        bool named = isNameToken(tokens.type(i));
+        if (named != (atom != AtomTable::NO_ATOM) || (named && tokens.atoms()->name(atom) != tokens.lexeme(i))) {
+            std::cerr << "Mismatch: token " << i << " < " << tokens.lexeme(i) << " > has the wrong atom" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Checks that partners in `blocks` pair up both ways, open before they close, sit at the
+// same depth and enclose only deeper tokens, and that unbalanced tokens have no partner.
+inline bool verifyBlocks(const BlockIndex& blocks, size_t tokenCount) {
+    bool ok = blocks.size() == tokenCount;
+    for (size_t i = 0; ok && i < blocks.size(); i++) {
+        uint32_t partner = blocks.partner(i);
+        if (partner == BlockIndex::NO_PARTNER) continue;
+        ok = partner < blocks.size() && blocks.partner(partner) == i && blocks.depth(partner) == blocks.depth(i);
+        if (ok && partner > i) {
+            for (size_t k = i + 1; ok && k < partner; k++) ok = blocks.depth(k) > blocks.depth(i);
+        }
+    }
+    for (uint32_t i : blocks.unbalanced()) ok = ok && i < blocks.size() && blocks.partner(i) == BlockIndex::NO_PARTNER;
+    if (!ok) std::cerr << "Mismatch: block index is inconsistent" << std::endl;
+    return ok;
+}
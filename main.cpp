@@ -1,282 +1,387 @@
-#include <iostream>
-#include <string>
-#include <vector>
-#include <cctype>
-#include <unordered_set>
-#include <unordered_map>
-#include <fstream>
-#include <sstream>
+#include "lexer.h"
 
-enum class TokenType {
-    NUMBER_INT,
-    NUMBER_FLOAT,
-    NUMBER_HEX,
+using namespace handwritten;
 
-    STRING_LITERAL,
+// Batch lexing with the hand-written lexer. With `definitions` set, each file's definitions
+// are collected and merged into it in path order.
+struct BatchEngine {
+    using Extra = std::unique_ptr<DefinitionIndex>;
 
-    IDENTIFIER_LOCAL,    
-    IDENTIFIER_INSTANCE, 
-    IDENTIFIER_CLASS,    
-    IDENTIFIER_GLOBAL,   
-    CONSTANT,            
+    DefinitionIndex* definitions = nullptr;
 
-    SYMBOL,              
-    KEYWORD,
-    OPERATOR,
-    SEPARATOR,           
-    COMMENT,
-    
-    RANGE_INCLUSIVE,     
-    RANGE_EXCLUSIVE,     
+    std::string_view name() const { return "lexer"; }
 
-    UNKNOWN,             
-    END_OF_FILE          
+    void lex(std::string_view source, TokenBuffer& tokens, LexerStats* stats) const {
+        if (stats) Lexer(source).analyzeInto(tokens, *stats);
+        else Lexer(source).analyzeInto(tokens);
+    }
+
+    void inspect(const std::string& path, std::string_view source, const TokenBuffer& tokens, Extra& extra) const {
+        if (!definitions) return;
+        extra = std::make_unique<DefinitionIndex>();
+        extra->addFile(path, source, tokens);
+    }
+
+    void merge(const Extra& extra) {
+        if (extra) definitions->merge(*extra);
+    }
 };
 
-struct Token {
-    TokenType type;
-    std::string lexeme; 
-    int line;           
+struct SearchResult {
+    std::string output;
+    bool failed = false;
+    bool lexed = false;
+    size_t hits = 0;
 };
 
-std::string tokenTypeToString(TokenType type) {
-    static const std::unordered_map<TokenType, std::string> typeMap = {
-        {TokenType::NUMBER_INT, "NUMBER_INT"},
-        {TokenType::NUMBER_FLOAT, "NUMBER_FLOAT"},
-        {TokenType::NUMBER_HEX, "NUMBER_HEX"},
-        {TokenType::STRING_LITERAL, "STRING_LITERAL"},
-        {TokenType::IDENTIFIER_LOCAL, "IDENTIFIER_LOCAL"},
-        {TokenType::IDENTIFIER_INSTANCE, "IDENTIFIER_INSTANCE"},
-        {TokenType::IDENTIFIER_CLASS, "IDENTIFIER_CLASS"},
-        {TokenType::IDENTIFIER_GLOBAL, "IDENTIFIER_GLOBAL"},
-        {TokenType::CONSTANT, "CONSTANT"},
-        {TokenType::SYMBOL, "SYMBOL"},
-        {TokenType::KEYWORD, "KEYWORD"},
-        {TokenType::OPERATOR, "OPERATOR"},
-        {TokenType::SEPARATOR, "SEPARATOR"},
-        {TokenType::COMMENT, "COMMENT"},
-        {TokenType::RANGE_INCLUSIVE, "RANGE_INCLUSIVE"},
-        {TokenType::RANGE_EXCLUSIVE, "RANGE_EXCLUSIVE"},
-        {TokenType::UNKNOWN, "UNKNOWN"},
-        {TokenType::END_OF_FILE, "END_OF_FILE"}
-    };
-    auto it = typeMap.find(type);
-    if (it != typeMap.end()) {
-        return it->second;
+SearchResult searchFile(const std::string& path, const TokenSearch& search) {
+    SearchResult result;
+    SourceFile file;
+    if (!file.open(path)) {
+        result.failed = true;
+        result.output = "Error: Unable to open " + path + "\n";
+        return result;
     }
-    return "INVALID_TOKEN_TYPE";
+    if (!search.mayMatch(file.view())) return result;
+    result.lexed = true;
+    TokenBuffer tokens;
+    Lexer(file.view()).analyzeInto(tokens);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        std::string_view lexeme = tokens.lexeme(i);
+        if (!search.matches(tokens.type(i), lexeme)) continue;
+        result.output.append(path).append(":").append(std::to_string(tokens.location(i).line)).append(": ");
+        result.output.append(lexeme).append("\n");
+        result.hits++;
+    }
+    return result;
 }
 
+// Prints every token in `paths` that `search` matches as "path:line: lexeme", files in path
+// order. Files are searched through runInPathOrder(), like runBatch() lexes them; those the
+// raw byte prefilter rules out are never lexed. A summary goes to stderr. Returns
+// 0 when something matched, 1 when nothing did and 2 when a file could not be read, like grep.
+int runSearch(const std::vector<std::string>& paths, unsigned threads, const TokenSearch& search) {
+    auto started = std::chrono::steady_clock::now();
+    size_t failures = 0, lexed = 0, hits = 0;
+
+    runInPathOrder<SearchResult>(paths, threads, [&](size_t i) { return searchFile(paths[i], search); },
+                                 [&](SearchResult& ready) {
+        (ready.failed ? std::cerr : std::cout) << ready.output;
+        failures += ready.failed;
+        lexed += ready.lexed;
+        hits += ready.hits;
+    });
+    std::cout.flush();
 
-class Lexer {
-public:
-    Lexer(std::string source) : source(std::move(source)), current(0), line(1) {}
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    std::cerr << "Searched " << paths.size() - failures << " files (" << lexed << " lexed, "
+              << paths.size() - failures - lexed << " ruled out unlexed), " << hits << " matches in "
+              << elapsed.count() << " ms on " << std::max(1u, threads) << " threads";
+    if (failures) std::cerr << ", " << failures << " failed";
+    std::cerr << std::endl;
+    return failures ? 2 : hits ? 0 : 1;
+}
 
-    std::vector<Token> analyze() {
-        std::vector<Token> tokens;
-        while (!isAtEnd()) {
-            start = current;
-            char c = advance();
-            scanToken(c, tokens);
+// Compares two token vectors over the same source, lexemes by position, and reports the
+// first difference.
+bool compareTokens(const std::vector<TokenView>& expected, const std::vector<TokenView>& actual, const char* actualName, bool quiet = false) {
+    auto samePlace = [](std::string_view a, std::string_view b) {
+        return a.size() == b.size() && (a.empty() || a.data() == b.data());
+    };
+    size_t count = std::min(expected.size(), actual.size());
+    for (size_t i = 0; i < count; i++) {
+        const TokenView& a = expected[i];
+        const TokenView& b = actual[i];
+        if (a.type != b.type || !samePlace(a.lexeme, b.lexeme) || a.line != b.line || a.keyword != b.keyword || a.op != b.op ||
+            !sameNumber(a, b)) {
+            std::cerr << "Mismatch at token " << i << ": sequential < " << a.lexeme << " > "
+                      << tokenTypeToString(a.type) << " line " << a.line
+                      << ", " << actualName << " < " << b.lexeme << " > "
+                      << tokenTypeToString(b.type) << " line " << b.line << std::endl;
+            return false;
         }
-        tokens.push_back({TokenType::END_OF_FILE, "", line});
-        return tokens;
     }
+    if (expected.size() != actual.size()) {
+        std::cerr << "Mismatch: sequential produced " << expected.size() << " tokens, " << actualName << " produced "
+                  << actual.size() << std::endl;
+        return false;
+    }
+    if (!quiet) std::cout << "OK: " << actual.size() << " " << actualName << " tokens match the sequential lexer" << std::endl;
+    return true;
+}
 
-private:
-    std::string source;
-    int start = 0;
-    int current = 0;
-    int line = 1;
-
-    const std::unordered_set<std::string> rubyKeywords = {
-        "alias", "and", "begin", "break", "case", "class", "def", "defined?", 
-        "do", "else", "elsif", "end", "ensure", "false", "for", "if", "in", 
-        "module", "next", "nil", "not", "or", "redo", "rescue", "retry", 
-        "return", "self", "super", "then", "true", "undef", "unless", 
-        "until", "when", "while", "yield"
+// Applies a fixed pseudo-random series of edits (deletions, and insertions of slices of the
+// source) through an IncrementalLexer and checks each result against a full re-lex.
+bool verifyIncremental(std::string_view source, int edits = 100) {
+    IncrementalLexer incremental{std::string(source)};
+    uint64_t seed = 0x9e3779b97f4a7c15ull;
+    auto random = [&seed](size_t bound) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        return bound ? static_cast<size_t>(seed >> 33) % bound : 0;
     };
+    for (int i = 0; i < edits; i++) {
+        size_t size = incremental.text().size();
+        size_t offset = random(size + 1);
+        size_t removed = random(3) == 0 ? 0 : random(std::min<size_t>(size - offset, 16) + 1);
+        size_t from = random(source.size() + 1);
+        std::string_view inserted = random(3) == 1 ? std::string_view() : source.substr(from, random(17));
+        incremental.edit(offset, removed, inserted);
 
-    bool isAtEnd() { return current >= source.length(); }
-    char advance() { return source[current++]; }
-    char peek() { if (isAtEnd()) return '\0'; return source[current]; }
-    char peekNext() { if (current + 1 >= source.length()) return '\0'; return source[current + 1]; }
-    bool match(char expected) {
-        if (isAtEnd() || source[current] != expected) return false;
-        current++;
-        return true;
-    }
-    
-    void addToken(TokenType type, std::vector<Token>& tokens) {
-        std::string lexeme = source.substr(start, current - start);
-        tokens.push_back({type, lexeme, line});
+        std::vector<TokenView> expected = Lexer(incremental.text()).analyze();
+        if (!compareTokens(expected, incremental.tokens(), "incremental", true)) {
+            std::cerr << "  after edit " << i << " at offset " << offset << " removing " << removed
+                      << " bytes, inserting " << inserted.size() << std::endl;
+            return false;
+        }
     }
+    std::cout << "OK: " << edits << " incremental edits match the sequential lexer" << std::endl;
+    return true;
+}
 
-    void scanToken(char c, std::vector<Token>& tokens) {
-        switch (c) {
-            case '(': case ')': case '[': case ']': case '{': case '}': case ',': case ';':
-                addToken(TokenType::SEPARATOR, tokens);
-                break;
-
-            case '!': addToken(match('=') ? TokenType::OPERATOR : TokenType::OPERATOR, tokens); break;
-            case '=': addToken(match('=') || match('>') ? TokenType::OPERATOR : TokenType::OPERATOR, tokens); break;
-            case '<': addToken(match('=') ? TokenType::OPERATOR : TokenType::OPERATOR, tokens); break;
-            case '>': addToken(match('=') ? TokenType::OPERATOR : TokenType::OPERATOR, tokens); break;
-            case '+': addToken(match('=') ? TokenType::OPERATOR : TokenType::OPERATOR, tokens); break;
-            case '*': addToken(match('*') || match('=') ? TokenType::OPERATOR : TokenType::OPERATOR, tokens); break;
-            case '/': addToken(match('=') ? TokenType::OPERATOR : TokenType::OPERATOR, tokens); break;
-            case '|': addToken(match('|') ? TokenType::OPERATOR : TokenType::OPERATOR, tokens); break;
+// Checks that a definition index over `tokens` survives encoding: the file reads back, every
+// name is found by its own prefix, and loading and re-encoding gives the same bytes.
+bool verifyDefinitions(std::string_view source, const std::vector<TokenView>& tokens) {
+    DefinitionIndex index;
+    index.addFile("-", source, tokens);
+    std::string encoded = index.encode();
+    DefinitionFile file;
+    bool ok = file.load(encoded) && file.current() && file.size() == index.size();
+    for (size_t i = 0; ok && i < file.size(); i++) {
+        auto [first, last] = file.findPrefix(file[i].name);
+        ok = first <= i && i < last;
+    }
+    if (ok) {
+        DefinitionIndex reloaded;
+        reloaded.load(file);
+        ok = reloaded.encode() == encoded;
+    }
+    if (!ok) std::cerr << "Mismatch: definition index could not be read back" << std::endl;
+    return ok;
+}
 
-            case '#':
-                while (peek() != '\n' && !isAtEnd()) advance();
-                addToken(TokenType::COMMENT, tokens);
-                break;
+// Checks analyzeParallel(), analyzeInto() with interning and a block index, a token cache
+// and definition index round trip, pipelined lexing and incremental edits against analyze().
+bool verifyLexer(std::string_view source, unsigned threads, size_t minChunk) {
+    std::vector<TokenView> sequential = Lexer(source).analyze();
+    bool ok = compareTokens(sequential, Lexer(source).analyzeParallel(threads, minChunk), "parallel");
+    AtomTable atoms;
+    TokenBuffer buffer(&atoms);
+    BlockIndex blocks;
+    Lexer(source).analyzeInto(buffer, blocks);
+    ok = compareTokens(sequential, std::vector<TokenView>(buffer.begin(), buffer.end()), "buffered") && ok;
+    ok = verifyAtoms(buffer) && ok;
+    ok = verifyBlocks(blocks, sequential.size()) && ok;
 
-            case '.':
-                if (match('.')) {
-                    addToken(match('.') ? TokenType::RANGE_EXCLUSIVE : TokenType::RANGE_INCLUSIVE, tokens);
-                } else {
-                     addToken(TokenType::OPERATOR, tokens);
-                }
-                break;
-            
-            case ':':
-                if (isalpha(peek()) || peek() == '_') {
-                    advance(); 
-                    while (isalnum(peek()) || peek() == '_') advance();
-                    addToken(TokenType::SYMBOL, tokens);
-                } else {
-                    addToken(TokenType::OPERATOR, tokens);
-                }
-                break;
-            
-            case '"': case '\'':
-                scanString(c, tokens);
-                break;
+    std::string encoded = encodeTokenCache(source, sequential);
+    TokenCache cache;
+    std::vector<TokenView> cached;
+    if (!cache.load(encoded) || !cache.matches(source) || !cache.decode(source, cached)) {
+        std::cerr << "Mismatch: token cache could not be read back" << std::endl;
+        return false;
+    }
+    ok = compareTokens(sequential, cached, "cached") && ok;
+    ok = verifyDefinitions(source, sequential) && ok;
 
-            case ' ': case '\r': case '\t': break;
-            case '\n': line++; break;
+    // A ring far smaller than the input, so the lexer fills it, wraps and waits many times.
+    std::vector<TokenView> piped;
+    lexPipelined(source, [&piped](const TokenView& token) { piped.push_back(token); }, 16, 5);
+    ok = compareTokens(sequential, piped, "pipelined") && ok;
+    return verifyIncremental(source) && ok;
+}
 
-            default:
-                if (isdigit(c)) {
-                    if (c == '0' && (peek() == 'x' || peek() == 'X')) {
-                        advance(); 
-                        while (isxdigit(peek())) {
-                            advance();
-                        }
-                        addToken(TokenType::NUMBER_HEX, tokens);
-                    } else { 
-                        while (isdigit(peek())) {
-                            advance();
-                        }
-                        if (peek() == '.' && isdigit(peekNext())) {
-                            advance(); 
-                            while (isdigit(peek())) {
-                                advance();
-                            }
-                            addToken(TokenType::NUMBER_FLOAT, tokens);
-                        } else {
-                            addToken(TokenType::NUMBER_INT, tokens);
-                        }
-                    }
-                } else if (isalpha(c) || c == '_') {
-                    scanIdentifier(tokens);
-                } else if (c == '@' || c == '$') {
-                    scanPrefixedIdentifier(tokens);
-                }
-                else {
-                    addToken(TokenType::UNKNOWN, tokens);
-                }
-                break;
-        }
+// Prints every definition in the index at `path` whose name starts with `prefix`, as
+// "path:line: kind name", followed by " in Scope" inside a class or module. Exits like
+// grep, and like --search: 0 with matches, 1 without, 2 when the index cannot be read.
+int lookupDefinitions(const std::string& path, std::string_view prefix) {
+    DefinitionFile index;
+    if (!index.open(path)) {
+        std::cerr << "Error: Unable to read definition index " << path << std::endl;
+        return 2;
     }
+    if (!index.current()) std::cerr << "Warning: " << path << " was written by another lexer version" << std::endl;
+    auto [first, last] = index.findPrefix(prefix);
+    std::string out;
+    for (size_t i = first; i < last; i++) {
+        Definition d = index[i];
+        out.append(d.path).append(":").append(std::to_string(d.line)).append(": ");
+        out.append(definitionKindNames[static_cast<size_t>(d.kind)]).append(" ").append(d.name);
+        if (!d.scope.empty()) out.append(" in ").append(d.scope);
+        out += '\n';
+    }
+    std::cout << out;
+    return first < last ? 0 : 1;
+}
 
-    void scanString(char quote_type, std::vector<Token>& tokens) {
-        while (peek() != quote_type && !isAtEnd()) {
-            if (peek() == '\n') line++;
-            if (peek() == '\\' && peekNext() == quote_type) {
-                advance();
+int main(int argc, char* argv[]) {
+    unsigned threads = 1;
+    size_t minChunk = Lexer::PARALLEL_MIN_CHUNK;
+    bool verify = false;
+    std::string cachePath;
+    bool batch = false;
+    bool listTokens = false;
+    bool intern = false;
+    StatsFormat statsFormat = StatsFormat::NONE;
+    bool stream = false;
+    bool showBlocks = false;
+    bool pipeline = false;
+    OutputFormat format = OutputFormat::HUMAN;
+    size_t blockSize = TokenStream::DEFAULT_BLOCK_SIZE;
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::string fileList;
+    std::string indexPath;
+    std::string lookup;
+    bool lookingUp = false;
+    TokenSearch search;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--parallel") threads = std::max(1u, std::thread::hardware_concurrency());
+        else if (arg.rfind("--parallel=", 0) == 0) threads = std::max(1, std::atoi(arg.c_str() + 11));
+        else if (arg.rfind("--min-chunk=", 0) == 0) minChunk = std::strtoull(arg.c_str() + 12, nullptr, 10);
+        else if (arg == "--verify") verify = true;
+        else if (arg.rfind("--cache=", 0) == 0) cachePath = arg.substr(8);
+        else if (arg == "--batch") batch = true;
+        else if (arg.rfind("--files-from=", 0) == 0) { batch = true; fileList = arg.substr(13); }
+        else if (arg.rfind("--jobs=", 0) == 0) jobs = std::max(1, std::atoi(arg.c_str() + 7));
+        else if (arg == "--tokens") listTokens = true;
+        else if (arg == "--intern") intern = true;
+        else if (arg.rfind("--stats=", 0) == 0) {
+            if (!parseStatsFormat(arg.substr(8), statsFormat)) {
+                std::cerr << "Error: Unknown stats format " << arg.substr(8) << " (expected json or prometheus)" << std::endl;
+                return 1;
             }
-            advance();
-        }
-        if (isAtEnd()) {
-            addToken(TokenType::UNKNOWN, tokens); 
-            return;
         }
-        advance(); 
-        addToken(TokenType::STRING_LITERAL, tokens);
-    }
-    
-    void scanIdentifier(std::vector<Token>& tokens) {
-        current--;
-        
-        while (isalnum(peek()) || peek() == '_') {
-            advance();
+        else if (arg == "--stream") stream = true;
+        else if (arg == "--blocks") showBlocks = true;
+        else if (arg == "--pipeline") pipeline = true;
+        else if (arg.rfind("--search=", 0) == 0) {
+            if (!search.add(arg.substr(9))) {
+                std::cerr << "Error: Bad search pattern " << arg.substr(9) << " (expected [TYPE:]NAME or [TYPE:]PREFIX*)" << std::endl;
+                return 2;
+            }
         }
-        std::string lexeme = source.substr(start, current - start);
-        if (isupper(lexeme[0])) {
-            addToken(TokenType::CONSTANT, tokens);
-        } else if (rubyKeywords.count(lexeme)) {
-            addToken(TokenType::KEYWORD, tokens);
-        } else {
-            addToken(TokenType::IDENTIFIER_LOCAL, tokens);
+        else if (arg.rfind("--index=", 0) == 0) indexPath = arg.substr(8);
+        else if (arg.rfind("--lookup=", 0) == 0) { lookingUp = true; lookup = arg.substr(9); }
+        else if (arg.rfind("--format=", 0) == 0) {
+            if (!parseOutputFormat(arg.substr(9), format)) {
+                std::cerr << "Error: Unknown output format " << arg.substr(9) << " (expected human or tsv)" << std::endl;
+                return 1;
+            }
         }
+        else if (arg.rfind("--block=", 0) == 0) blockSize = std::strtoull(arg.c_str() + 8, nullptr, 10);
+        else inputs.push_back(arg);
     }
-    
-    void scanPrefixedIdentifier(std::vector<Token>& tokens) {
-        char prefix = source[start];
-        TokenType type;
-        if (prefix == '$') {
-            type = TokenType::IDENTIFIER_GLOBAL;
-        } else if (prefix == '@') {
-            type = match('@') ? TokenType::IDENTIFIER_CLASS : TokenType::IDENTIFIER_INSTANCE;
-        } else {
-            addToken(TokenType::UNKNOWN, tokens); 
-            return;
-        }
-        
-        if (isalpha(peek()) || peek() == '_') {
-             while (isalnum(peek()) || peek() == '_') advance();
-             addToken(type, tokens);
-        } else {
-             addToken(TokenType::OPERATOR, tokens);
+
+    // --lookup only reads the index; --index with inputs lexes them in batch and folds their
+    // definitions into the index file, keeping what it holds for other files.
+    if (lookingUp) {
+        if (indexPath.empty()) {
+            std::cerr << "Error: --lookup needs --index=PATH" << std::endl;
+            return 1;
         }
+        return lookupDefinitions(indexPath, lookup);
     }
-};
 
+    if (batch || !indexPath.empty() || !search.empty()) {
+        if (!fileList.empty()) {
+            std::vector<std::string> listed = readPathList(fileList);
+            inputs.insert(inputs.end(), listed.begin(), listed.end());
+        }
+        if (!search.empty()) return runSearch(collectBatchInputs(inputs), jobs, search);
+        AtomTable atoms;
+        BatchOptions options;
+        options.listTokens = listTokens;
+        options.format = format;
+        options.atoms = intern ? &atoms : nullptr;
+        options.stats = statsFormat;
+        BatchEngine engine;
+        if (indexPath.empty()) return runBatch(collectBatchInputs(inputs), jobs, options, engine);
 
-void printTokens(const std::vector<Token>& tokens) {
-    for (const auto& token : tokens) {
-        std::cout << "Line " << token.line << ":\t"
-                  << "< " << token.lexeme << " >"
-                  << "\t -> " << tokenTypeToString(token.type)
-                  << std::endl;
+        DefinitionIndex definitions;
+        DefinitionFile existing;
+        if (existing.open(indexPath) && existing.current()) definitions.load(existing);
+        engine.definitions = &definitions;
+        int status = runBatch(collectBatchInputs(inputs), jobs, options, engine);
+        if (!writeFileAtomically(indexPath, definitions.encode())) {
+            std::cerr << "Error: Unable to write definition index " << indexPath << std::endl;
+            return 1;
+        }
+        std::cout << "Indexed " << definitions.size() << " definitions in " << definitions.fileCount() << " files" << std::endl;
+        return status;
     }
-}
 
+    std::string filename = inputs.empty() ? "" : inputs.back();
+    if (filename.empty()) {
+        std::cout << "Enter the name of the file to read from: ";
+        std::cin >> filename;
+    }
 
-int main() {
-    std::string filename;
-    std::cout << "Enter the name of the file to read from: ";
-    std::cin >> filename;
+    if (stream) {
+        return streamTokens<TokenStream>(filename, blockSize, format) ? 0 : 1;
+    }
 
-    std::ifstream file(filename);
-    if (!file.is_open()) {
+    SourceFile file;
+    if (!file.open(filename)) {
         std::cerr << "Error: Unable to open " << filename << std::endl;
         return 1;
     }
+    std::string_view ruby_code = file.view();
 
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    std::string ruby_code = buffer.str();
+    if (verify) {
+        return verifyLexer(ruby_code, std::max(threads, 2u), minChunk) ? 0 : 1;
+    }
 
-    std::cout << "--- Analyzing Ruby Code (Regular solution) ---" << std::endl;
-    std::cout << ruby_code << std::endl;
-    std::cout << "--------------------------" << std::endl;
+    if (format == OutputFormat::HUMAN) {
+        std::cout << "--- Analyzing Ruby Code (Regular solution) ---" << std::endl;
+        std::cout << ruby_code << std::endl;
+        std::cout << "--------------------------" << std::endl;
+    }
 
-    Lexer lexer(ruby_code);
-    std::vector<Token> tokens = lexer.analyze();
-    printTokens(tokens);
+    // With --cache, tokens come from the cache file when it matches this source and lexer;
+    // otherwise the file is lexed and the cache rewritten.
+    // With --blocks, a sequential lex matches blocks as it goes; cached or parallel tokens
+    // are fed to the index afterwards. With --pipeline the lexer runs on a thread of its
+    // own and tokens are printed as it produces them, kept only if something later needs them.
+    std::vector<TokenView> tokens;
+    BlockIndex blocks;
+    TokenCache cache;
+    TokenWriter writer(STDOUT_FILENO, format);
+    bool printed = false;
+    bool cached = !cachePath.empty() && cache.open(cachePath) && cache.matches(ruby_code) && cache.decode(ruby_code, tokens);
+    if (!cached) {
+        Lexer lexer(ruby_code);
+        if (pipeline) {
+            bool keep = showBlocks || !cachePath.empty();
+            if (showBlocks) blocks.reset(ruby_code);
+            lexPipelined(ruby_code, [&](const TokenView& token) {
+                writer.write(token);
+                if (showBlocks) blocks.add(token);
+                if (keep) tokens.push_back(token);
+            });
+            printed = true;
+        } else if (threads > 1) tokens = lexer.analyzeParallel(threads, minChunk);
+        else tokens = showBlocks ? lexer.analyze(blocks) : lexer.analyze();
+        if (!cachePath.empty() && !writeTokenCache(cachePath, ruby_code, tokens)) {
+            std::cerr << "Warning: Unable to write token cache " << cachePath << std::endl;
+        }
+    }
+    if (showBlocks && blocks.empty()) {
+        blocks.reset(ruby_code);
+        for (const TokenView& token : tokens) blocks.add(token);
+    }
+    if (!printed) printTokens(tokens, writer);
+    if (!writer.flush()) {
+        std::cerr << "Error: Unable to write output" << std::endl;
+        return 1;
+    }
+    if (showBlocks) std::cerr << blocks.report(tokens);
+    // Counted in a pass of its own, so the printed tokens come from the usual path.
+    if (statsFormat != StatsFormat::NONE) {
+        LexerStats stats;
+        TokenBuffer counted;
+        Lexer(ruby_code).analyzeInto(counted, stats);
+        std::cerr << stats.report(statsFormat, "lexer");
+    }
 
     return 0;
-}
\ No newline at end of file
+}
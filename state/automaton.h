@@ -0,0 +1,678 @@
+// The finite-automaton lexer: a table-driven engine with a switch-based reference, its
+// tracers and counters, and streaming over it.
+#pragma once
+
+#include "../lexer_common.h"
+
+namespace automaton {
+
+// One automaton step. `from` is a state; `to` is a state, or TRACE_ACCEPT | TokenType when the
+// step emitted a token. The character is recovered from `offset` when the trace is printed.
+struct TraceEntry {
+    uint8_t from;
+    uint8_t to;
+    uint32_t offset;
+};
+
+constexpr uint8_t TRACE_ACCEPT = 0x80;
+
+// Tracer policy for the production build: every hook is empty and compiles away.
+struct NullTracer {
+    static constexpr bool enabled = false;
+    void record(uint8_t, uint8_t, uint32_t) {}
+    void endToken(const TokenView&) {}
+};
+
+// Debug tracer: keeps the transitions of all tokens in one arena, split by token end marks.
+class TransitionTrace {
+public:
+    static constexpr bool enabled = true;
+
+    void record(uint8_t from, uint8_t to, uint32_t offset) { entries.push_back({from, to, offset}); }
+    void endToken(const TokenView&) { tokenEnds.push_back(entries.size()); }
+
+    // Transitions taken while scanning the token at `index` in analyze()'s output.
+    std::pair<const TraceEntry*, const TraceEntry*> forToken(size_t index) const {
+        size_t first = index == 0 ? 0 : tokenEnds[index - 1];
+        return {entries.data() + first, entries.data() + tokenEnds[index]};
+    }
+
+private:
+    std::vector<TraceEntry> entries;
+    std::vector<size_t> tokenEnds;
+};
+
+class LexerFiniteAutomaton {
+private:
+    
+    enum class State {
+        START,
+        IN_IDENTIFIER_LOCAL, 
+        IN_CONSTANT,
+        SAW_AT, 
+        IN_INSTANCE_VAR, 
+        SAW_DOUBLE_AT, 
+        IN_CLASS_VAR,
+        SAW_DOLLAR, 
+        IN_GLOBAL_VAR, 
+        SAW_COLON, 
+        IN_SYMBOL,
+        IN_COMMENT, 
+        SAW_DOT, 
+        IN_RANGE
+    };
+    static constexpr int STATE_COUNT = static_cast<int>(State::IN_RANGE) + 1;
+
+    // Byte-equivalence classes for the table-driven engine: every byte in a class takes the
+    // same transition out of every state. CC_OPERATOR is every byte that starts an operator
+    // on its own; the operator trie finishes those, as the number scanner finishes CC_DIGIT.
+    // CC_NON_ASCII, every byte of a multi-byte character, is a lowercase letter to the table.
+    enum CharClass : uint8_t {
+        CC_OTHER, CC_NUL, CC_NEWLINE,
+        CC_LOWER, CC_UPPER, CC_UNDERSCORE, CC_DIGIT, CC_NON_ASCII,
+        CC_AT, CC_DOLLAR, CC_COLON, CC_HASH, CC_QUOTE, CC_DOT,
+        CC_SEPARATOR, CC_OPERATOR,
+        CC_COUNT
+    };
+
+    // '.' and ':' start operators too, but have states of their own for ranges and symbols.
+    static constexpr std::string_view OPERATOR_START_BYTES = "=<>!+-*/%&|^~?";
+
+    // A table cell is one byte: the flags in the top three bits and, below them, the next
+    // state, or the token type when the step emits (the next state is then always START).
+    using Step = uint8_t;
+
+    enum StepFlags : uint8_t {
+        STEP_CONSUME = 0x20,   // advance past the current byte
+        STEP_TRACE = 0x40,     // record a Transition for the current byte
+        STEP_EMIT = 0x80,      // stop and emit a token of the type in the low bits
+        STEP_TARGET = 0x1f
+    };
+
+    static_assert(STATE_COUNT <= STEP_TARGET + 1 && TOKEN_TYPE_COUNT <= STEP_TARGET + 1, "a step target must fit its five bits");
+
+    static constexpr State nextState(Step step) { return static_cast<State>(step & STEP_TARGET); }
+    static constexpr TokenType emittedType(Step step) { return static_cast<TokenType>(step & STEP_TARGET); }
+
+    // States that loop on every byte of a run, which the table engine skips in one kernel
+    // call when nothing traces the individual steps.
+    enum Run : uint8_t { RUN_NONE, RUN_NAME, RUN_COMMENT };
+
+    using CharClassMap = std::array<uint8_t, 256>;
+    using TransitionTable = std::array<std::array<Step, CC_COUNT>, STATE_COUNT>;
+
+    std::string_view source;
+    int start = 0;
+    int current = 0;
+    LexModes modes;
+
+    friend class StreamScanner;
+
+    static constexpr std::string_view stateNames[STATE_COUNT] = {
+        "START",
+        "IN_IDENTIFIER_LOCAL",
+        "IN_CONSTANT",
+        "SAW_AT",
+        "IN_INSTANCE_VAR",
+        "SAW_DOUBLE_AT",
+        "IN_CLASS_VAR",
+        "SAW_DOLLAR",
+        "IN_GLOBAL_VAR",
+        "SAW_COLON",
+        "IN_SYMBOL",
+        "IN_COMMENT",
+        "SAW_DOT",
+        "IN_RANGE"
+    };
+
+    template <typename Tracer>
+    void trace(Tracer& tracer, State from, State to, int at) {
+        if constexpr (Tracer::enabled) tracer.record(static_cast<uint8_t>(from), static_cast<uint8_t>(to), at);
+    }
+
+    template <typename Tracer>
+    void traceAccept(Tracer& tracer, State from, TokenType type, int at) {
+        if constexpr (Tracer::enabled) tracer.record(static_cast<uint8_t>(from), TRACE_ACCEPT | static_cast<uint8_t>(type), at);
+    }
+
+    // Traces the accept of a token a scanner took over after its first byte, under the type
+    // the scanner settled on rather than the one the automaton handed it off as.
+    template <typename Tracer>
+    TokenView acceptedFrom(State from, TokenView token, Tracer& tracer) {
+        traceAccept(tracer, from, token.type, start);
+        return token;
+    }
+
+    const ScanKernels& kernels = ScanKernels::best();
+
+    bool isAtEnd() { return current >= source.length(); }
+    char advance() { return source[current++]; }
+    char peek() { return isAtEnd() ? '\0' : source[current]; }
+    char peekNext() { return (current + 1 >= source.length()) ? '\0' : source[current + 1]; }
+    
+    static constexpr CharClassMap buildCharClassMap() {
+        CharClassMap map{};
+        for (int c = 'a'; c <= 'z'; c++) map[c] = CC_LOWER;
+        for (int c = 'A'; c <= 'Z'; c++) map[c] = CC_UPPER;
+        for (int c = '0'; c <= '9'; c++) map[c] = CC_DIGIT;
+        for (int c = 0x80; c < 256; c++) map[c] = CC_NON_ASCII;
+        map['_'] = CC_UNDERSCORE;
+        map['\0'] = CC_NUL;
+        map['\n'] = CC_NEWLINE;
+        map['@'] = CC_AT;
+        map['$'] = CC_DOLLAR;
+        map[':'] = CC_COLON;
+        map['#'] = CC_HASH;
+        map['"'] = CC_QUOTE;
+        map['.'] = CC_DOT;
+        for (char c : {'(', ')', '[', ']', '{', '}', ',', ';'}) map[static_cast<unsigned char>(c)] = CC_SEPARATOR;
+        for (char c : OPERATOR_START_BYTES) map[static_cast<unsigned char>(c)] = CC_OPERATOR;
+        return map;
+    }
+
+    // Mirrors the cases of scanNextToken() one for one; analyzeReference() runs that switch
+    // so the two can be compared.
+    static constexpr TransitionTable buildTransitionTable() {
+        TransitionTable table{};
+        constexpr CharClass alpha[] = {CC_LOWER, CC_UPPER, CC_UNDERSCORE, CC_NON_ASCII};
+        constexpr CharClass alnum[] = {CC_LOWER, CC_UPPER, CC_UNDERSCORE, CC_NON_ASCII, CC_DIGIT};
+
+        auto row = [&](State s) -> std::array<Step, CC_COUNT>& { return table[static_cast<int>(s)]; };
+        auto fill = [&](State s, Step step) { for (auto& cell : row(s)) cell = step; };
+        auto go = [](State next) { return Step(static_cast<uint8_t>(next) | STEP_CONSUME | STEP_TRACE); };
+        auto accept = [](TokenType type) { return Step(static_cast<uint8_t>(type) | STEP_EMIT); };
+        auto acceptAfter = [](TokenType type) { return Step(static_cast<uint8_t>(type) | STEP_TRACE | STEP_EMIT); };
+        auto acceptWith = [](TokenType type) { return Step(static_cast<uint8_t>(type) | STEP_CONSUME | STEP_TRACE | STEP_EMIT); };
+        // Leaves the table for a scanner that settles the type; the accept is traced after it.
+        auto handOff = [](TokenType type) { return Step(static_cast<uint8_t>(type) | STEP_CONSUME | STEP_EMIT); };
+
+        fill(State::START, acceptWith(TokenType::UNKNOWN));
+        for (CharClass c : {CC_LOWER, CC_UNDERSCORE, CC_NON_ASCII}) row(State::START)[c] = go(State::IN_IDENTIFIER_LOCAL);
+        row(State::START)[CC_UPPER] = go(State::IN_CONSTANT);
+        // Numbers leave the table after their first digit too; the number scanner settles the type.
+        row(State::START)[CC_DIGIT] = handOff(TokenType::NUMBER_INT);
+        row(State::START)[CC_AT] = go(State::SAW_AT);
+        row(State::START)[CC_DOLLAR] = go(State::SAW_DOLLAR);
+        row(State::START)[CC_COLON] = go(State::SAW_COLON);
+        row(State::START)[CC_HASH] = go(State::IN_COMMENT);
+        // Strings leave the table at their quote; scanQuotedString() finds the end.
+        row(State::START)[CC_QUOTE] = handOff(TokenType::STRING_LITERAL);
+        row(State::START)[CC_DOT] = go(State::SAW_DOT);
+        // strchr() matches the terminator, so the switch reads a NUL byte as a separator.
+        row(State::START)[CC_SEPARATOR] = handOff(TokenType::SEPARATOR);
+        row(State::START)[CC_NUL] = handOff(TokenType::SEPARATOR);
+        // Operators leave the table after their first byte; finishTableToken() runs the trie.
+        row(State::START)[CC_OPERATOR] = handOff(TokenType::OPERATOR);
+
+        const std::pair<State, TokenType> words[] = {
+            {State::IN_IDENTIFIER_LOCAL, TokenType::IDENTIFIER_LOCAL},
+            {State::IN_CONSTANT, TokenType::CONSTANT},
+            {State::IN_INSTANCE_VAR, TokenType::IDENTIFIER_INSTANCE},
+            {State::IN_CLASS_VAR, TokenType::IDENTIFIER_CLASS},
+            {State::IN_GLOBAL_VAR, TokenType::IDENTIFIER_GLOBAL},
+            {State::IN_SYMBOL, TokenType::SYMBOL}
+        };
+        for (const auto& [state, type] : words) {
+            fill(state, accept(type));
+            for (CharClass c : alnum) row(state)[c] = go(state);
+        }
+
+        fill(State::SAW_AT, accept(TokenType::OPERATOR));
+        row(State::SAW_AT)[CC_AT] = go(State::SAW_DOUBLE_AT);
+        for (CharClass c : alpha) row(State::SAW_AT)[c] = go(State::IN_INSTANCE_VAR);
+
+        fill(State::SAW_DOUBLE_AT, accept(TokenType::UNKNOWN));
+        for (CharClass c : alpha) row(State::SAW_DOUBLE_AT)[c] = go(State::IN_CLASS_VAR);
+
+        fill(State::SAW_DOLLAR, accept(TokenType::OPERATOR));
+        for (CharClass c : alpha) row(State::SAW_DOLLAR)[c] = go(State::IN_GLOBAL_VAR);
+
+        fill(State::SAW_COLON, accept(TokenType::OPERATOR));
+        row(State::SAW_COLON)[CC_COLON] = acceptWith(TokenType::OPERATOR);
+        for (CharClass c : alpha) row(State::SAW_COLON)[c] = go(State::IN_SYMBOL);
+
+        fill(State::IN_COMMENT, go(State::IN_COMMENT));
+        row(State::IN_COMMENT)[CC_NEWLINE] = accept(TokenType::COMMENT);
+        row(State::IN_COMMENT)[CC_NUL] = accept(TokenType::COMMENT);
+
+        fill(State::SAW_DOT, accept(TokenType::OPERATOR));
+        row(State::SAW_DOT)[CC_DOT] = go(State::IN_RANGE);
+
+        fill(State::IN_RANGE, acceptAfter(TokenType::RANGE_INCLUSIVE));
+        row(State::IN_RANGE)[CC_DOT] = acceptWith(TokenType::RANGE_EXCLUSIVE);
+
+        return table;
+    }
+
+    // Each name state loops over exactly the bytes identifierEnd() skips, and IN_COMMENT over
+    // everything up to a newline or NUL.
+    static constexpr std::array<Run, STATE_COUNT> buildRuns() {
+        std::array<Run, STATE_COUNT> runs{};
+        for (State s : {State::IN_IDENTIFIER_LOCAL, State::IN_CONSTANT, State::IN_INSTANCE_VAR, State::IN_CLASS_VAR,
+                        State::IN_GLOBAL_VAR, State::IN_SYMBOL}) {
+            runs[static_cast<int>(s)] = RUN_NAME;
+        }
+        runs[static_cast<int>(State::IN_COMMENT)] = RUN_COMMENT;
+        return runs;
+    }
+
+    // Names take any non-ASCII bytes; one whose bytes are not well-formed UTF-8 is UNKNOWN.
+    static void checkName(TokenView& token) {
+        if (isNameToken(token.type) && !isWellFormedUtf8(token.lexeme)) token.type = TokenType::UNKNOWN;
+    }
+
+    // Tokens leave the scanner without a line; collect() and BasicTokenStream fill it in.
+    TokenView makeToken(TokenType type) { return {type, source.substr(start, current - start), 0}; }
+
+    // Extends a number whose first digit is consumed to the whole literal and decodes it.
+    TokenView makeNumberToken() {
+        NumberLiteral literal = scanNumberLiteral(source.substr(start));
+        current = start + static_cast<int>(literal.length);
+        return {literal.type, source.substr(start, current - start), 0, Keyword::NOT_KEYWORD,
+                Operator::NOT_OPERATOR, literal.bigInteger, literal.value};
+    }
+
+    // Extends an operator whose first bytes are consumed to the longest match in the trie. A
+    // bare '@' or '$' matches nothing and stays an OPERATOR without a sub-kind. A "<<" that
+    // opens a heredoc is a HEREDOC_BEGIN instead.
+    TokenView makeOperatorToken() {
+        if (source[start] == '<') {
+            if (size_t length = scanHeredocStart(source, start, modes)) {
+                current = start + static_cast<int>(length);
+                return makeToken(TokenType::HEREDOC_BEGIN);
+            }
+        }
+        OperatorMatch match = matchOperator(source.substr(start));
+        if (static_cast<int>(match.length) > current - start) current = start + static_cast<int>(match.length);
+        return {TokenType::OPERATOR, source.substr(start, current - start), 0, Keyword::NOT_KEYWORD, match.op};
+    }
+    
+    // A string whose opening quote is consumed, or its head up to an interpolation.
+    TokenView makeStringToken() { return makeToken(scanQuotedString(source, start, current, modes, kernels)); }
+
+    // Braces also open and close interpolations; see braceType().
+    TokenView makeSeparatorToken() {
+        char c = source[start];
+        return makeToken(c == '{' || c == '}' ? braceType(c, modes) : TokenType::SEPARATOR);
+    }
+
+    // The next piece of the string or heredoc body the lexer is in, scanned outside the
+    // automaton and traced as a single accept.
+    template <typename Tracer>
+    TokenView makeStringModeToken(Tracer& tracer) {
+        TokenType type = scanStringMode(source, start, current, modes, kernels);
+        traceAccept(tracer, State::START, type, start);
+        return makeToken(type);
+    }
+
+    // Whitespace after a heredoc opener is skipped only through the newline that ends its
+    // line; the first body starts there.
+    void skipToHeredocBody() {
+        while (isSpaceByte(peek())) {
+            if (advance() == '\n') {
+                modes.beginHeredocBody();
+                return;
+            }
+        }
+    }
+
+    template <typename Tracer>
+    TokenView makeIdentifierToken(Tracer& tracer) {
+        if (startsUppercase(source.substr(start, current - start))) { return makeToken(TokenType::CONSTANT); }
+        Keyword keyword = classifyKeyword(source.substr(start, current - start));
+        // A trailing '?' is part of the word only when it completes a keyword (defined?).
+        if (keyword == Keyword::NOT_KEYWORD && peek() == '?') {
+            keyword = classifyKeyword(source.substr(start, current - start + 1));
+            if (keyword != Keyword::NOT_KEYWORD) {
+                traceAccept(tracer, State::IN_IDENTIFIER_LOCAL, TokenType::KEYWORD, current);
+                advance();
+            }
+        }
+        if (keyword != Keyword::NOT_KEYWORD) { return {TokenType::KEYWORD, source.substr(start, current - start), 0, keyword}; }
+        return makeToken(TokenType::IDENTIFIER_LOCAL);
+    }
+
+public:
+    // The automaton does not copy the source; tokens it returns point into it.
+    LexerFiniteAutomaton(std::string_view source) : source(source) {}
+
+    // Runs the compiled transition table. Pass a TransitionTrace to record every step.
+    std::vector<TokenView> analyze() {
+        NullTracer tracer;
+        return analyze(tracer);
+    }
+
+    template <typename Tracer>
+    std::vector<TokenView> analyze(Tracer& tracer) {
+        std::vector<TokenView> tokens;
+        collect<true>(tokens, tracer);
+        return tokens;
+    }
+
+    // analyze() and analyzeReference() into a TokenBuffer, which is reset for this source and
+    // pre-sized from an estimate of the token count.
+    void analyzeInto(TokenBuffer& tokens) {
+        NullTracer tracer;
+        analyzeInto(tokens, tracer);
+    }
+
+    template <typename Tracer>
+    void analyzeInto(TokenBuffer& tokens, Tracer& tracer) {
+        tokens.reset(source);
+        collect<true>(tokens, tracer);
+    }
+
+    void analyzeReferenceInto(TokenBuffer& tokens) {
+        NullTracer tracer;
+        analyzeReferenceInto(tokens, tracer);
+    }
+
+    template <typename Tracer>
+    void analyzeReferenceInto(TokenBuffer& tokens, Tracer& tracer) {
+        tokens.reset(source);
+        collect<false>(tokens, tracer);
+    }
+
+    // Runs the hand-written switch automaton, the reference the table is checked against.
+    std::vector<TokenView> analyzeReference() {
+        NullTracer tracer;
+        return analyzeReference(tracer);
+    }
+
+    template <typename Tracer>
+    std::vector<TokenView> analyzeReference(Tracer& tracer) {
+        std::vector<TokenView> tokens;
+        collect<false>(tokens, tracer);
+        return tokens;
+    }
+
+    // Name of a TraceEntry endpoint: a state, or the token type for TRACE_ACCEPT targets.
+    static std::string_view traceTargetName(uint8_t target) {
+        if (target & TRACE_ACCEPT) return tokenTypeToString(static_cast<TokenType>(target & ~TRACE_ACCEPT));
+        if (target < STATE_COUNT) return stateNames[target];
+        return "UNKNOWN_STATE";
+    }
+
+private:
+    // Scans every token with the table engine (Table) or the switch automaton into `tokens`,
+    // telling the tracer where each one ends. A TokenBuffer looks lines up itself; a vector
+    // gets them from a LineIndex afterwards, in one forward walk. Names are checked for
+    // malformed UTF-8 only when the source as a whole fails validation.
+    template <bool Table, typename Tokens, typename Tracer>
+    void collect(Tokens& tokens, Tracer& tracer) {
+        constexpr bool buffered = std::is_same_v<Tokens, TokenBuffer>;
+        const bool validated = kernels.validUtf8(source.data(), source.data() + source.size());
+        while (!isAtEnd()) {
+            TokenView token = Table ? scanNextTokenTable(tracer) : scanNextToken(tracer);
+            if (token.type == TokenType::END_OF_FILE) break;
+            if (!validated) checkName(token);
+            tokens.push_back(token);
+            tracer.endToken(token);
+        }
+        TokenView end{TokenType::END_OF_FILE, "", 0};
+        tokens.push_back(end);
+        tracer.endToken(end);
+
+        if constexpr (!buffered) {
+            LineIndex lines(source);
+            LineIndex::Cursor cursor(lines);
+            for (TokenView& token : tokens) {
+                size_t offset = token.type == TokenType::END_OF_FILE ? source.size() : token.lexeme.data() - source.data();
+                token.line = cursor.line(offset);
+            }
+        }
+    }
+
+    template <typename Tracer>
+    TokenView scanNextTokenTable(Tracer& tracer) {
+        static constexpr CharClassMap charClass = buildCharClassMap();
+        static constexpr TransitionTable table = buildTransitionTable();
+        static constexpr std::array<Run, STATE_COUNT> runs = buildRuns();
+        const char* end = source.data() + source.size();
+
+        // Most gaps between tokens are a single space; the kernel pays off only past that.
+        if (modes.inCode()) {
+            int newlines = 0;
+            if (!modes.pending.empty()) skipToHeredocBody();
+            else if (isSpaceByte(peek())) current = kernels.skipWhitespace(source.data() + current + 1, end, newlines) - source.data();
+        }
+        start = current;
+
+        if (isAtEnd()) return makeToken(TokenType::END_OF_FILE);
+        if (!modes.inCode()) return makeStringModeToken(tracer);
+
+        State state = State::START;
+        while (true) {
+            Step step = table[static_cast<int>(state)][charClass[static_cast<unsigned char>(peek())]];
+
+            if constexpr (Tracer::enabled) {
+                if (step & STEP_TRACE) {
+                    if (step & STEP_EMIT) traceAccept(tracer, state, emittedType(step), current);
+                    else trace(tracer, state, nextState(step), current);
+                }
+            }
+            if (step & STEP_CONSUME) current++;
+            if (step & STEP_EMIT) return finishTableToken(emittedType(step), state, tracer);
+            state = nextState(step);
+
+            if constexpr (!Tracer::enabled) {
+                if (runs[static_cast<int>(state)] == RUN_NAME) {
+                    current = kernels.identifierEnd(source.data() + current, end) - source.data();
+                } else if (runs[static_cast<int>(state)] == RUN_COMMENT) {
+                    current = kernels.findFirstOf(source.data() + current, end, '\n', '\0', '\n') - source.data();
+                }
+            }
+        }
+    }
+
+    template <typename Tracer>
+    TokenView finishTableToken(TokenType type, State from, Tracer& tracer) {
+        switch (type) {
+            case TokenType::IDENTIFIER_LOCAL: return makeIdentifierToken(tracer);
+            case TokenType::NUMBER_INT: return acceptedFrom(from, makeNumberToken(), tracer);
+            // Only START hands operators off untraced; "::" was traced when SAW_COLON accepted it.
+            case TokenType::OPERATOR:
+                return from == State::START ? acceptedFrom(from, makeOperatorToken(), tracer) : makeOperatorToken();
+            case TokenType::SEPARATOR: return acceptedFrom(from, makeSeparatorToken(), tracer);
+            case TokenType::STRING_LITERAL: return acceptedFrom(from, makeStringToken(), tracer);
+            default: return makeToken(type);
+        }
+    }
+
+    template <typename Tracer>
+    TokenView scanNextToken(Tracer& tracer) {
+        start = current;
+        State currentState = State::START;
+        
+        
+        if (modes.inCode()) {
+            if (modes.pending.empty()) while(isSpaceByte(peek())) advance();
+            else skipToHeredocBody();
+        }
+        start = current;
+
+        if (isAtEnd()) return makeToken(TokenType::END_OF_FILE);
+        if (!modes.inCode()) return makeStringModeToken(tracer);
+
+        char c = advance(); 
+        State prevState = currentState;
+        
+        if (hasByteClass(c, BYTE_LOWER | BYTE_UNDERSCORE | BYTE_NON_ASCII)) { currentState = State::IN_IDENTIFIER_LOCAL; }
+        else if (hasByteClass(c, BYTE_UPPER)) { currentState = State::IN_CONSTANT; }
+        else if (isDigitByte(c)) {
+            return acceptedFrom(prevState, makeNumberToken(), tracer);
+        }
+        else if (c == '@') { currentState = State::SAW_AT; }
+        else if (c == '$') { currentState = State::SAW_DOLLAR; }
+        else if (c == ':') { currentState = State::SAW_COLON; }
+        else if (c == '#') { currentState = State::IN_COMMENT; }
+        else if (c == '"') {
+            return acceptedFrom(prevState, makeStringToken(), tracer);
+        }
+        else if (c == '.') { currentState = State::SAW_DOT; }
+        else if (strchr("()[]{},;", c)) {
+            return acceptedFrom(prevState, makeSeparatorToken(), tracer);
+        }
+        else if (OPERATOR_START_BYTES.find(c) != std::string_view::npos) {
+            return acceptedFrom(prevState, makeOperatorToken(), tracer);
+        }
+        else {
+            traceAccept(tracer, prevState, TokenType::UNKNOWN, start);
+            return makeToken(TokenType::UNKNOWN);
+        }
+        
+        trace(tracer, prevState, currentState, start);
+
+        while (true) {
+            char p = peek();
+            int at = current;
+            prevState = currentState;
+
+            switch (currentState) {
+                case State::IN_IDENTIFIER_LOCAL: case State::IN_CONSTANT:
+                case State::IN_INSTANCE_VAR: case State::IN_CLASS_VAR:
+                case State::IN_GLOBAL_VAR: case State::IN_SYMBOL:
+                    if (!isIdentifierByte(p)) return makeIdentifierTokenByType(currentState, tracer);
+                    advance();
+                    trace(tracer, prevState, currentState, at);
+                    break;
+
+                case State::SAW_AT:
+                    if (p == '@') { advance(); currentState = State::SAW_DOUBLE_AT; }
+                    else if (isWordStartByte(p)) { advance(); currentState = State::IN_INSTANCE_VAR; }
+                    else return makeOperatorToken();
+                    trace(tracer, prevState, currentState, at);
+                    break;
+                
+                case State::SAW_DOUBLE_AT:
+                    if (isWordStartByte(p)) { advance(); currentState = State::IN_CLASS_VAR; }
+                    else return makeToken(TokenType::UNKNOWN);
+                    trace(tracer, prevState, currentState, at);
+                    break;
+
+                case State::SAW_DOLLAR:
+                    if (isWordStartByte(p)) { advance(); currentState = State::IN_GLOBAL_VAR; }
+                    else return makeOperatorToken();
+                    trace(tracer, prevState, currentState, at);
+                    break;
+
+                case State::SAW_COLON:
+                    if (isWordStartByte(p)) { advance(); currentState = State::IN_SYMBOL; }
+                    else if (p == ':') {
+                        advance();
+                        traceAccept(tracer, prevState, TokenType::OPERATOR, at);
+                        return makeOperatorToken();
+                    }
+                    else return makeOperatorToken();
+                    trace(tracer, prevState, currentState, at);
+                    break;
+                
+                case State::IN_COMMENT:
+                    if (p == '\n' || p == '\0') return makeToken(TokenType::COMMENT);
+                    advance();
+                    trace(tracer, prevState, currentState, at);
+                    break;
+                
+                case State::SAW_DOT:
+                    if (p == '.') { advance(); currentState = State::IN_RANGE; }
+                    else return makeOperatorToken();
+                    trace(tracer, prevState, currentState, at);
+                    break;
+
+                case State::IN_RANGE:
+                    if (p == '.') {
+                        advance();
+                        traceAccept(tracer, prevState, TokenType::RANGE_EXCLUSIVE, at);
+                        return makeToken(TokenType::RANGE_EXCLUSIVE);
+                    }
+                    else {
+                        traceAccept(tracer, prevState, TokenType::RANGE_INCLUSIVE, at);
+                        return makeToken(TokenType::RANGE_INCLUSIVE);
+                    }
+                    break;
+
+                default:
+                    return makeToken(TokenType::UNKNOWN);
+            }
+        }
+    }
+
+    template <typename Tracer>
+    TokenView makeIdentifierTokenByType(State s, Tracer& tracer) {
+        switch (s) {
+            case State::IN_IDENTIFIER_LOCAL: return makeIdentifierToken(tracer);
+            case State::IN_CONSTANT: return makeToken(TokenType::CONSTANT);
+            case State::IN_INSTANCE_VAR: return makeToken(TokenType::IDENTIFIER_INSTANCE);
+            case State::IN_CLASS_VAR: return makeToken(TokenType::IDENTIFIER_CLASS);
+            case State::IN_GLOBAL_VAR: return makeToken(TokenType::IDENTIFIER_GLOBAL);
+            case State::IN_SYMBOL: return makeToken(TokenType::SYMBOL);
+            default: return makeToken(TokenType::UNKNOWN);
+        }
+    }
+};
+
+// Tracer policy that feeds a LexerStats.
+struct StatsTracer {
+    static constexpr bool enabled = true;
+    LexerStats& stats;
+
+    explicit StatsTracer(LexerStats& stats) : stats(stats) { stats.countTransitions(LexerFiniteAutomaton::traceTargetName); }
+
+    void record(uint8_t from, uint8_t to, uint32_t) { stats.recordTransition(from, to); }
+    void endToken(const TokenView& token) { stats.recordToken(token.type, token.lexeme.size()); }
+};
+
+// Tracer policy that feeds each token to a BlockIndex as the automaton emits it. Records
+// no transitions.
+struct BlockTracer {
+    static constexpr bool enabled = false;
+    BlockIndex& blocks;
+
+    void record(uint8_t, uint8_t, uint32_t) {}
+    void endToken(const TokenView& token) { blocks.add(token); }
+};
+
+using LexerSession = BasicLexerSession<LexerFiniteAutomaton>;
+
+// How a TokenStream drives the automaton: one table-engine token at a time over the
+// stream's buffer.
+class StreamScanner {
+public:
+    LexModes& modes() { return lexer.modes; }
+
+    bool scan(std::string_view buffer, size_t pos, size_t& end, TokenView& token) {
+        lexer.source = buffer;
+        lexer.current = pos;
+        NullTracer tracer;
+        TokenView scanned = lexer.scanNextTokenTable(tracer);
+        end = lexer.current;
+        if (scanned.type == TokenType::END_OF_FILE) return false;
+        token = scanned;
+        LexerFiniteAutomaton::checkName(token);
+        return true;
+    }
+
+private:
+    LexerFiniteAutomaton lexer{std::string_view()};
+};
+
+using TokenStream = BasicTokenStream<StreamScanner>;
+
+inline void printTokens(const std::vector<TokenView>& tokens, TokenWriter& writer,
+                 const TransitionTrace* trace = nullptr, std::string_view source = {}) {
+    for (size_t i = 0; i < tokens.size(); i++) {
+        writer.write(tokens[i]);
+        if (!trace) continue;
+        auto [first, last] = trace->forToken(i);
+        if (first != last) {
+            writer.writeRaw("  Transitions:\n");
+            for (const TraceEntry* t = first; t != last; t++) {
+                char character = t->offset < source.size() ? source[t->offset] : '\0';
+                writer.writeTransition(LexerFiniteAutomaton::traceTargetName(t->from), character,
+                                       LexerFiniteAutomaton::traceTargetName(t->to));
+            }
+        }
+    }
+}
+
+}  // namespace automaton
@@ -1,428 +1,213 @@
-#include <iostream>
-#include <string>
-#include <vector>
-#include <cctype>
-#include <unordered_set>
-#include <unordered_map>
-#include <fstream>
-#include <sstream>
+#include "automaton.h"
 
- 
-enum class TokenType {
-    NUMBER_INT,
-    NUMBER_FLOAT,
-    NUMBER_HEX,
+using namespace automaton;
 
-    STRING_LITERAL,
+// Batch lexing with the table engine, or with the reference automaton when `reference` is
+// set. Collects nothing per file besides tokens and stats.
+struct BatchEngine {
+    struct Extra {};
 
-    IDENTIFIER_LOCAL,    
-    IDENTIFIER_INSTANCE, 
-    IDENTIFIER_CLASS,    
-    IDENTIFIER_GLOBAL,   
-    CONSTANT,            
+    bool reference = false;
 
-    SYMBOL,              
-    KEYWORD,
-    OPERATOR,
-    SEPARATOR,           
-    COMMENT,
-    
-    RANGE_INCLUSIVE,     
-    RANGE_EXCLUSIVE,     
+    std::string_view name() const { return reference ? "automaton-reference" : "automaton"; }
 
-    UNKNOWN,             
-    END_OF_FILE          
-};
-
-struct Transition {
-    std::string fromState;
-    char character;
-    std::string toState;
-};
-
-struct Token {
-    TokenType type;
-    std::string lexeme; 
-    int line;           
-    std::vector<Transition> transitions;
-};
-
-std::string tokenTypeToString(TokenType type) {
-    static const std::unordered_map<TokenType, std::string> typeMap = {
-        {TokenType::NUMBER_INT, "NUMBER_INT"},
-        {TokenType::NUMBER_FLOAT, "NUMBER_FLOAT"},
-        {TokenType::NUMBER_HEX, "NUMBER_HEX"},
-        {TokenType::STRING_LITERAL, "STRING_LITERAL"},
-        {TokenType::IDENTIFIER_LOCAL, "IDENTIFIER_LOCAL"},
-        {TokenType::IDENTIFIER_INSTANCE, "IDENTIFIER_INSTANCE"},
-        {TokenType::IDENTIFIER_CLASS, "IDENTIFIER_CLASS"},
-        {TokenType::IDENTIFIER_GLOBAL, "IDENTIFIER_GLOBAL"},
-        {TokenType::CONSTANT, "CONSTANT"},
-        {TokenType::SYMBOL, "SYMBOL"},
-        {TokenType::KEYWORD, "KEYWORD"},
-        {TokenType::OPERATOR, "OPERATOR"},
-        {TokenType::SEPARATOR, "SEPARATOR"},
-        {TokenType::COMMENT, "COMMENT"},
-        {TokenType::RANGE_INCLUSIVE, "RANGE_INCLUSIVE"},
-        {TokenType::RANGE_EXCLUSIVE, "RANGE_EXCLUSIVE"},
-        {TokenType::UNKNOWN, "UNKNOWN"},
-        {TokenType::END_OF_FILE, "END_OF_FILE"}
-    };
-    auto it = typeMap.find(type);
-    if (it != typeMap.end()) {
-        return it->second;
+    void lex(std::string_view source, TokenBuffer& tokens, LexerStats* stats) const {
+        LexerFiniteAutomaton lexer(source);
+        if (stats) {
+            StatsTracer tracer{*stats};
+            if (reference) lexer.analyzeReferenceInto(tokens, tracer);
+            else lexer.analyzeInto(tokens, tracer);
+        } else if (reference) {
+            lexer.analyzeReferenceInto(tokens);
+        } else {
+            lexer.analyzeInto(tokens);
+        }
     }
-    return "INVALID_TOKEN_TYPE";
-}
-
- 
 
-class LexerFiniteAutomaton {
-private:
-    
-    enum class State {
-        START,
-        IN_IDENTIFIER_LOCAL, 
-        IN_CONSTANT,
-        SAW_ZERO, 
-        IN_NUMBER_INT, 
-        IN_NUMBER_FLOAT, 
-        IN_HEX_NUMBER,
-        SAW_AT, 
-        IN_INSTANCE_VAR, 
-        SAW_DOUBLE_AT, 
-        IN_CLASS_VAR,
-        SAW_DOLLAR, 
-        IN_GLOBAL_VAR, 
-        SAW_COLON, 
-        IN_SYMBOL,
-        IN_STRING, 
-        IN_COMMENT, 
-        SAW_DOT, 
-        IN_RANGE,
-        SAW_EQUALS, 
-        SAW_PLUS,
-        SAW_MINUS, 
-        SAW_STAR, 
-        SAW_SLASH, 
-        SAW_PIPE 
-    };
-
-    std::string source;
-    int start = 0;
-    int current = 0;
-    int line = 1;
+    void inspect(const std::string&, std::string_view, const TokenBuffer&, Extra&) const {}
+    void merge(const Extra&) {}
+};
 
-    const std::unordered_set<std::string> rubyKeywords = {
-        "alias", "and", "begin", "break", "case", "class", "def", "defined?", 
-        "do", "else", "elsif", "end", "ensure", "false", "for", "if", "in", 
-        "module", "next", "nil", "not", "or", "redo", "rescue", "retry", 
-        "return", "self", "super", "then", "true", "undef", "unless", 
-        "until", "when", "while", "yield"
+bool verifyEngines(std::string_view source) {
+    TransitionTrace tableTrace;
+    TransitionTrace referenceTrace;
+    std::vector<TokenView> table = LexerFiniteAutomaton(source).analyze(tableTrace);
+    std::vector<TokenView> reference = LexerFiniteAutomaton(source).analyzeReference(referenceTrace);
+
+    auto sameTransitions = [&](size_t i) {
+        auto [a, aEnd] = tableTrace.forToken(i);
+        auto [b, bEnd] = referenceTrace.forToken(i);
+        if (aEnd - a != bEnd - b) return false;
+        for (; a != aEnd; a++, b++) {
+            if (a->from != b->from || a->to != b->to || a->offset != b->offset) return false;
+        }
+        return true;
     };
 
-    std::string stateToString(State state) {
-        static const std::unordered_map<State, std::string> stateMap = {
-            {State::START, "START"},
-            {State::IN_IDENTIFIER_LOCAL, "IN_IDENTIFIER_LOCAL"},
-            {State::IN_CONSTANT, "IN_CONSTANT"},
-            {State::SAW_ZERO, "SAW_ZERO"},
-            {State::IN_NUMBER_INT, "IN_NUMBER_INT"},
-            {State::IN_NUMBER_FLOAT, "IN_NUMBER_FLOAT"},
-            {State::IN_HEX_NUMBER, "IN_HEX_NUMBER"},
-            {State::SAW_AT, "SAW_AT"},
-            {State::IN_INSTANCE_VAR, "IN_INSTANCE_VAR"},
-            {State::SAW_DOUBLE_AT, "SAW_DOUBLE_AT"},
-            {State::IN_CLASS_VAR, "IN_CLASS_VAR"},
-            {State::SAW_DOLLAR, "SAW_DOLLAR"},
-            {State::IN_GLOBAL_VAR, "IN_GLOBAL_VAR"},
-            {State::SAW_COLON, "SAW_COLON"},
-            {State::IN_SYMBOL, "IN_SYMBOL"},
-            {State::IN_STRING, "IN_STRING"},
-            {State::IN_COMMENT, "IN_COMMENT"},
-            {State::SAW_DOT, "SAW_DOT"},
-            {State::IN_RANGE, "IN_RANGE"},
-            {State::SAW_EQUALS, "SAW_EQUALS"},
-            {State::SAW_PLUS, "SAW_PLUS"},
-            {State::SAW_MINUS, "SAW_MINUS"},
-            {State::SAW_STAR, "SAW_STAR"},
-            {State::SAW_SLASH, "SAW_SLASH"},
-            {State::SAW_PIPE, "SAW_PIPE"}
-        };
-        auto it = stateMap.find(state);
-        if (it != stateMap.end()) {
-            return it->second;
+    size_t count = std::min(table.size(), reference.size());
+    for (size_t i = 0; i < count; i++) {
+        const TokenView& a = table[i];
+        const TokenView& b = reference[i];
+        if (a.type != b.type || a.lexeme != b.lexeme || a.line != b.line || a.op != b.op ||
+            !sameNumber(a, b) || !sameTransitions(i)) {
+            std::cerr << "Mismatch at token " << i << ": table < " << a.lexeme << " > "
+                      << tokenTypeToString(a.type) << " line " << a.line
+                      << ", reference < " << b.lexeme << " > "
+                      << tokenTypeToString(b.type) << " line " << b.line << std::endl;
+            return false;
         }
-        return "UNKNOWN_STATE";
     }
-
-    bool isAtEnd() { return current >= source.length(); }
-    char advance() { return source[current++]; }
-    char peek() { return isAtEnd() ? '\0' : source[current]; }
-    char peekNext() { return (current + 1 >= source.length()) ? '\0' : source[current + 1]; }
-    
-    Token makeToken(TokenType type, const std::vector<Transition>& transitions) { return {type, source.substr(start, current - start), line, transitions}; }
-    
-    Token makeIdentifierToken(const std::vector<Transition>& transitions) {
-        std::string lexeme = source.substr(start, current - start);
-        if (isupper(lexeme[0])) { return {TokenType::CONSTANT, lexeme, line, transitions}; }
-        if (rubyKeywords.count(lexeme)) { return {TokenType::KEYWORD, lexeme, line, transitions}; }
-        return {TokenType::IDENTIFIER_LOCAL, lexeme, line, transitions};
+    if (table.size() != reference.size()) {
+        std::cerr << "Mismatch: table produced " << table.size() << " tokens, reference produced "
+                  << reference.size() << std::endl;
+        return false;
     }
 
-public:
-    LexerFiniteAutomaton(std::string source) : source(std::move(source)) {}
-
-    std::vector<Token> analyze() {
-        std::vector<Token> tokens;
-        while (!isAtEnd()) {
-            Token token = scanNextToken();
-            if (token.type == TokenType::END_OF_FILE) break;
-            tokens.push_back(token);
-        }
-        tokens.push_back({TokenType::END_OF_FILE, "", line, {}});
-        return tokens;
+    AtomTable atoms;
+    TokenBuffer buffer(&atoms);
+    LexerFiniteAutomaton(source).analyzeInto(buffer);
+    bool sameBuffer = buffer.size() == table.size();
+    for (size_t i = 0; sameBuffer && i < table.size(); i++) {
+        TokenView b = buffer[i];
+        sameBuffer = b.type == table[i].type && b.lexeme == table[i].lexeme && b.line == table[i].line && b.keyword == table[i].keyword && b.op == table[i].op &&
+                     sameNumber(b, table[i]);
     }
+    if (!sameBuffer) {
+        std::cerr << "Mismatch: analyzeInto() differs from analyze()" << std::endl;
+        return false;
+    }
+    if (!verifyAtoms(buffer)) return false;
+
+    BlockIndex blocks;
+    blocks.reset(source);
+    BlockTracer blockTracer{blocks};
+    LexerFiniteAutomaton(source).analyze(blockTracer);
+    if (!verifyBlocks(blocks, table.size())) return false;
+    std::cout << "OK: " << table.size() << " tokens match the reference automaton" << std::endl;
+    return true;
+}
 
-private:
-    Token scanNextToken() {
-        start = current;
-        State currentState = State::START;
-        std::vector<Transition> transitions;
-        
-        
-        while(isspace(peek())) {
-            if (peek() == '\n') line++;
-            advance();
-        }
-        start = current;
-
-        if (isAtEnd()) return makeToken(TokenType::END_OF_FILE, transitions);
-
-        char c = advance(); 
-        State prevState = currentState;
-        
-        if (islower(c) || c == '_') { currentState = State::IN_IDENTIFIER_LOCAL; }
-        else if (isupper(c)) { currentState = State::IN_CONSTANT; }
-        else if (c == '0') { currentState = State::SAW_ZERO; }
-        else if (isdigit(c)) { currentState = State::IN_NUMBER_INT; }
-        else if (c == '@') { currentState = State::SAW_AT; }
-        else if (c == '$') { currentState = State::SAW_DOLLAR; }
-        else if (c == ':') { currentState = State::SAW_COLON; }
-        else if (c == '#') { currentState = State::IN_COMMENT; }
-        else if (c == '"') { currentState = State::IN_STRING; }
-        else if (c == '.') { currentState = State::SAW_DOT; }
-        else if (c == '=') { currentState = State::SAW_EQUALS; } 
-        else if (c == '+') { currentState = State::SAW_PLUS; }
-        else if (c == '-') { currentState = State::SAW_MINUS; }
-        else if (c == '*') { currentState = State::SAW_STAR; }
-        else if (c == '/') { currentState = State::SAW_SLASH; }
-        else if (c == '|') { currentState = State::SAW_PIPE; }
-        else if (strchr("()[]{},;", c)) {
-            transitions.push_back({stateToString(prevState), c, "SEPARATOR"});
-            return makeToken(TokenType::SEPARATOR, transitions);
-        }
-        else if (strchr("<>!", c)) {
-            transitions.push_back({stateToString(prevState), c, "OPERATOR"});
-            return makeToken(TokenType::OPERATOR, transitions);
-        }
-        else {
-            transitions.push_back({stateToString(prevState), c, "UNKNOWN"});
-            return makeToken(TokenType::UNKNOWN, transitions);
+int main(int argc, char* argv[]) {
+    bool useReference = false;
+    bool verify = false;
+    bool showTrace = false;
+    bool batch = false;
+    bool listTokens = false;
+    bool intern = false;
+    StatsFormat statsFormat = StatsFormat::NONE;
+    bool stream = false;
+    bool showBlocks = false;
+    OutputFormat format = OutputFormat::HUMAN;
+    size_t blockSize = TokenStream::DEFAULT_BLOCK_SIZE;
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::string fileList;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--reference") useReference = true;
+        else if (arg == "--verify") verify = true;
+        else if (arg == "--trace") showTrace = true;
+        else if (arg == "--batch") batch = true;
+        else if (arg.rfind("--files-from=", 0) == 0) { batch = true; fileList = arg.substr(13); }
+        else if (arg.rfind("--jobs=", 0) == 0) jobs = std::max(1, std::atoi(arg.c_str() + 7));
+        else if (arg == "--tokens") listTokens = true;
+        else if (arg == "--intern") intern = true;
+        else if (arg.rfind("--stats=", 0) == 0) {
+            if (!parseStatsFormat(arg.substr(8), statsFormat)) {
+                std::cerr << "Error: Unknown stats format " << arg.substr(8) << " (expected json or prometheus)" << std::endl;
+                return 1;
+            }
         }
-        
-        transitions.push_back({stateToString(prevState), c, stateToString(currentState)});
-
-        while (true) {
-            char p = peek();
-            prevState = currentState;
-
-            switch (currentState) {
-                case State::IN_IDENTIFIER_LOCAL: case State::IN_CONSTANT:
-                case State::IN_INSTANCE_VAR: case State::IN_CLASS_VAR:
-                case State::IN_GLOBAL_VAR: case State::IN_SYMBOL:
-                    if (!isalnum(p) && p != '_') return makeIdentifierTokenByType(currentState, transitions);
-                    advance();
-                    transitions.push_back({stateToString(prevState), p, stateToString(currentState)});
-                    break;
-
-                case State::SAW_ZERO:
-                    if (p == 'x' || p == 'X') { advance(); currentState = State::IN_HEX_NUMBER; }
-                    else if (p == '.' && isdigit(peekNext())) { advance(); currentState = State::IN_NUMBER_FLOAT; }
-                    else if (isdigit(p)) { currentState = State::IN_NUMBER_INT; }
-                    else return makeToken(TokenType::NUMBER_INT, transitions);
-                    transitions.push_back({stateToString(prevState), p, stateToString(currentState)});
-                    break;
-
-                case State::IN_NUMBER_INT:
-                    if (p == '.' && isdigit(peekNext())) { advance(); currentState = State::IN_NUMBER_FLOAT; }
-                    else if (!isdigit(p)) return makeToken(TokenType::NUMBER_INT, transitions);
-                    else {
-                        advance();
-                        transitions.push_back({stateToString(prevState), p, stateToString(currentState)});
-                    }
-                    break;
-                    
-                case State::IN_NUMBER_FLOAT:
-                    if (!isdigit(p)) return makeToken(TokenType::NUMBER_FLOAT, transitions);
-                    advance();
-                    transitions.push_back({stateToString(prevState), p, stateToString(currentState)});
-                    break;
-
-                case State::IN_HEX_NUMBER:
-                    if (!isxdigit(p)) {
-                        if (current - start <= 2) return makeToken(TokenType::UNKNOWN, transitions);
-                        return makeToken(TokenType::NUMBER_HEX, transitions);
-                    }
-                    advance();
-                    transitions.push_back({stateToString(prevState), p, stateToString(currentState)});
-                    break;
-
-                case State::SAW_AT:
-                    if (p == '@') { advance(); currentState = State::SAW_DOUBLE_AT; }
-                    else if (isalpha(p) || p == '_') { advance(); currentState = State::IN_INSTANCE_VAR; }
-                    else return makeToken(TokenType::OPERATOR, transitions);
-                    transitions.push_back({stateToString(prevState), p, stateToString(currentState)});
-                    break;
-                
-                case State::SAW_DOUBLE_AT:
-                    if (isalpha(p) || p == '_') { advance(); currentState = State::IN_CLASS_VAR; }
-                    else return makeToken(TokenType::UNKNOWN, transitions);
-                    transitions.push_back({stateToString(prevState), p, stateToString(currentState)});
-                    break;
-
-                case State::SAW_DOLLAR:
-                    if (isalpha(p) || p == '_') { advance(); currentState = State::IN_GLOBAL_VAR; }
-                    else return makeToken(TokenType::OPERATOR, transitions);
-                    transitions.push_back({stateToString(prevState), p, stateToString(currentState)});
-                    break;
-
-                case State::SAW_COLON:
-                    if (isalpha(p) || p == '_') { advance(); currentState = State::IN_SYMBOL; }
-                    else return makeToken(TokenType::OPERATOR, transitions);
-                    transitions.push_back({stateToString(prevState), p, stateToString(currentState)});
-                    break;
-                
-                case State::IN_COMMENT:
-                    if (p == '\n' || p == '\0') return makeToken(TokenType::COMMENT, transitions);
-                    advance();
-                    transitions.push_back({stateToString(prevState), p, stateToString(currentState)});
-                    break;
-                
-                case State::IN_STRING:
-                    if (p == '"') {
-                        advance();
-                        transitions.push_back({stateToString(prevState), p, "STRING_LITERAL"});
-                        return makeToken(TokenType::STRING_LITERAL, transitions);
-                    }
-                    else if (p == '\0') return makeToken(TokenType::UNKNOWN, transitions);
-                    advance();
-                    transitions.push_back({stateToString(prevState), p, stateToString(currentState)});
-                    break;
-                
-                case State::SAW_DOT:
-                    if (p == '.') { advance(); currentState = State::IN_RANGE; }
-                    else return makeToken(TokenType::OPERATOR, transitions);
-                    transitions.push_back({stateToString(prevState), p, stateToString(currentState)});
-                    break;
-
-                case State::IN_RANGE:
-                    if (p == '.') {
-                        advance();
-                        transitions.push_back({stateToString(prevState), p, "RANGE_EXCLUSIVE"});
-                        return makeToken(TokenType::RANGE_EXCLUSIVE, transitions);
-                    }
-                    else {
-                        transitions.push_back({stateToString(prevState), p, "RANGE_INCLUSIVE"});
-                        return makeToken(TokenType::RANGE_INCLUSIVE, transitions);
-                    }
-                    break;
-
-                case State::SAW_EQUALS:
-                    if (p == '=' || p == '>') { advance(); }
-                    transitions.push_back({stateToString(prevState), p, "OPERATOR"});
-                    return makeToken(TokenType::OPERATOR, transitions);
-
-                case State::SAW_PLUS:
-                    if (p == '=') { advance(); }
-                    transitions.push_back({stateToString(prevState), p, "OPERATOR"});
-                    return makeToken(TokenType::OPERATOR, transitions);
-
-                case State::SAW_MINUS:
-                    if (p == '=') { advance(); }
-                    transitions.push_back({stateToString(prevState), p, "OPERATOR"});
-                    return makeToken(TokenType::OPERATOR, transitions);
-
-                case State::SAW_STAR:
-                    if (p == '=') { advance(); }
-                    transitions.push_back({stateToString(prevState), p, "OPERATOR"});
-                    return makeToken(TokenType::OPERATOR, transitions);
-
-                case State::SAW_SLASH:
-                    if (p == '=') { advance(); }
-                    transitions.push_back({stateToString(prevState), p, "OPERATOR"});
-                    return makeToken(TokenType::OPERATOR, transitions);
-                
-                case State::SAW_PIPE:
-                    if (p == '|') { advance(); }
-                    transitions.push_back({stateToString(prevState), p, "OPERATOR"});
-                    return makeToken(TokenType::OPERATOR, transitions);
-                default:
-                    return makeToken(TokenType::UNKNOWN, transitions);
+        else if (arg == "--stream") stream = true;
+        else if (arg == "--blocks") showBlocks = true;
+        else if (arg.rfind("--format=", 0) == 0) {
+            if (!parseOutputFormat(arg.substr(9), format)) {
+                std::cerr << "Error: Unknown output format " << arg.substr(9) << " (expected human or tsv)" << std::endl;
+                return 1;
             }
         }
+        else if (arg.rfind("--block=", 0) == 0) blockSize = std::strtoull(arg.c_str() + 8, nullptr, 10);
+        else inputs.push_back(arg);
     }
 
-    Token makeIdentifierTokenByType(State s, const std::vector<Transition>& transitions) {
-        switch (s) {
-            case State::IN_IDENTIFIER_LOCAL: return makeIdentifierToken(transitions);
-            case State::IN_CONSTANT: return makeToken(TokenType::CONSTANT, transitions);
-            case State::IN_INSTANCE_VAR: return makeToken(TokenType::IDENTIFIER_INSTANCE, transitions);
-            case State::IN_CLASS_VAR: return makeToken(TokenType::IDENTIFIER_CLASS, transitions);
-            case State::IN_GLOBAL_VAR: return makeToken(TokenType::IDENTIFIER_GLOBAL, transitions);
-            case State::IN_SYMBOL: return makeToken(TokenType::SYMBOL, transitions);
-            default: return makeToken(TokenType::UNKNOWN, transitions);
+    if (batch) {
+        if (!fileList.empty()) {
+            std::vector<std::string> listed = readPathList(fileList);
+            inputs.insert(inputs.end(), listed.begin(), listed.end());
         }
+        AtomTable atoms;
+        BatchOptions options;
+        options.listTokens = listTokens;
+        options.format = format;
+        options.atoms = intern ? &atoms : nullptr;
+        options.stats = statsFormat;
+        BatchEngine engine;
+        engine.reference = useReference;
+        return runBatch(collectBatchInputs(inputs), jobs, options, engine);
     }
-};
 
-void printTokens(const std::vector<Token>& tokens) {
-    for (const auto& token : tokens) {;
-        std::cout << "Line " << token.line << ":\t"
-                  << "< " << token.lexeme << " >"
-                  << "\t -> " << tokenTypeToString(token.type)
-                  << std::endl;
-        if (!token.transitions.empty()) {
-            std::cout << "  Transitions:" << std::endl;
-            for (const auto& t : token.transitions) {
-                std::cout << "    " << t.fromState << " --'" << t.character << "'--> " << t.toState << std::endl;
-            }
-        }
+    std::string filename = inputs.empty() ? "" : inputs.back();
+    if (filename.empty()) {
+        std::cout << "Enter the name of the file to read from: ";
+        std::cin >> filename;
     }
-}
 
-int main() {
-    std::string filename;
-    std::cout << "Enter the name of the file to read from: ";
-    std::cin >> filename;
+    if (stream) {
+        return streamTokens<TokenStream>(filename, blockSize, format) ? 0 : 1;
+    }
 
-    std::ifstream file(filename);
-    if (!file.is_open()) {
+    SourceFile file;
+    if (!file.open(filename)) {
         std::cerr << "Error: Unable to open " << filename << std::endl;
         return 1;
     }
+    std::string_view ruby_code = file.view();
 
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    std::string ruby_code = buffer.str();
+    if (verify) {
+        return verifyEngines(ruby_code) ? 0 : 1;
+    }
 
-    std::cout << "--- Analyzing Ruby Code (Finite Automaton) ---" << std::endl;
-    std::cout << ruby_code << std::endl;
-    std::cout << "--------------------------" << std::endl;
+    if (format == OutputFormat::HUMAN) {
+        std::cout << "--- Analyzing Ruby Code (Finite Automaton) ---" << std::endl;
+        std::cout << ruby_code << std::endl;
+        std::cout << "--------------------------" << std::endl;
+    }
 
+    TokenWriter writer(STDOUT_FILENO, format);
     LexerFiniteAutomaton lexer(ruby_code);
-    std::vector<Token> tokens = lexer.analyze();
-    printTokens(tokens);
+    std::vector<TokenView> tokens;
+    BlockIndex blocks;
+    if (showTrace) {
+        TransitionTrace trace;
+        tokens = useReference ? lexer.analyzeReference(trace) : lexer.analyze(trace);
+        printTokens(tokens, writer, &trace, ruby_code);
+    } else if (showBlocks) {
+        // Blocks are matched as the automaton emits the tokens.
+        blocks.reset(ruby_code);
+        BlockTracer tracer{blocks};
+        tokens = useReference ? lexer.analyzeReference(tracer) : lexer.analyze(tracer);
+        printTokens(tokens, writer);
+    } else {
+        tokens = useReference ? lexer.analyzeReference() : lexer.analyze();
+        printTokens(tokens, writer);
+    }
+    if (!writer.flush()) {
+        std::cerr << "Error: Unable to write output" << std::endl;
+        return 1;
+    }
+    if (showBlocks && blocks.empty()) {
+        blocks.reset(ruby_code);
+        for (const TokenView& token : tokens) blocks.add(token);
+    }
+    if (showBlocks) std::cerr << blocks.report(tokens);
+    // Counted in a pass of its own, so the printed tokens come from the usual path.
+    if (statsFormat != StatsFormat::NONE) {
+        LexerStats stats;
+        StatsTracer tracer{stats};
+        if (useReference) LexerFiniteAutomaton(ruby_code).analyzeReference(tracer);
+        else LexerFiniteAutomaton(ruby_code).analyze(tracer);
+        std::cerr << stats.report(statsFormat, useReference ? "automaton-reference" : "automaton");
+    }
 
     return 0;
 }